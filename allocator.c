@@ -85,6 +85,7 @@ void *arena_alloc(void *ctx, usize size) {
     void *aligned = align_forward((usize)data, align);
     usize delta = ((usize)aligned - (usize)data);
     if (head_alloc->head + size + delta <= head_alloc->capacity) {
+        head_alloc->last = head_alloc->head + delta;
         head_alloc->head += delta + size;
         memset(aligned, 0, size);
 
@@ -95,12 +96,36 @@ void *arena_alloc(void *ctx, usize size) {
     return NULL;
 }
 
-// For now, simply allocates new memory without checking if old memory can be
-// reused. Don't reuse a pointer passed into this function, always use the
-// returned pointer.
-// TODO check if this is the previous allocation and can therefore be reused
+// Grows or shrinks in place when ptr is the most recent allocation of its
+// block and the block has room, otherwise copies into a new allocation.
+// Don't reuse a pointer passed into this function, always use the returned
+// pointer.
 void *arena_realloc(void *ctx, void *ptr, usize size)
 {
+    Arena *a = (Arena*)ctx;
+    if (!ptr) return arena_alloc(ctx, size);
+
+    for (ArenaAllocation *node = a->first; node != NULL; node = node->next) {
+        u8 *p = (u8*)ptr;
+        if (p < node->data || p >= node->data + node->capacity)
+            continue;
+
+        usize offset = (usize)(p - node->data);
+        usize old_size = offset < node->head ? node->head - offset : 0;
+        if (offset == node->last && offset <= node->head && offset + size <= node->capacity) {
+            if (size > old_size)
+                memset(p + old_size, 0, size - old_size);
+            node->head = offset + size;
+            return ptr;
+        }
+
+        // The old size isn't tracked, but everything up to head is ours to read
+        void *new = arena_alloc(ctx, size);
+        if (new)
+            memcpy(new, ptr, old_size < size ? old_size : size);
+        return new;
+    }
+
     return arena_alloc(ctx, size);
 }
 
@@ -110,6 +135,7 @@ void arena_free(void *ctx, void *ptr) {}
 void arena_reset(Arena *a) {
     for (ArenaAllocation *node = a->first; node != NULL; node = node->next) {
         node->head = 0;
+        node->last = 0;
     }
 }
 
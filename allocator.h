@@ -81,6 +81,7 @@ typedef struct ArenaAllocation {
     struct ArenaAllocation *next;
     u8 *data;
     usize head;
+    usize last; // offset of the most recent allocation, which can grow in place
     usize capacity;
 } ArenaAllocation;
 
@@ -1,6 +1,18 @@
 #include "allocator.h"
+#include "csv.h"
 #include "fs.h"
+#include "fuzzy.h"
+#include "glob.h"
+#include "hash.h"
+#include "io_batch.h"
+#include "json.h"
+#include "lines.h"
 #include "log.h"
 #include "net.h"
+#include "number.h"
+#include "simd.h"
 #include "strings.h"
+#include "thread.h"
 #include "types.h"
+#include "walk.h"
+#include "watch.h"
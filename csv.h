@@ -0,0 +1,412 @@
+#ifndef CSV_H
+#define CSV_H
+
+// RFC 4180 CSV/TSV reader. Quotes, delimiters and newlines are classified 64
+// bytes at a time into bitmasks; a prefix xor over the quote mask gives the
+// quoted regions, so separators inside quotes drop out without a byte loop.
+// Fields are views into the input and only fields with doubled quotes are
+// copied out.
+
+#include "allocator.h"
+#include "fs.h"
+#include "simd.h"
+#include "strings.h"
+#include "types.h"
+
+typedef enum {
+    CsvOk,
+    CsvErrorQuote,      // unterminated quote or stray quote in a field
+    CsvErrorFieldCount, // row width differs from the first row (columns only)
+    CsvErrorMemory,
+} CsvResult;
+
+typedef struct {
+    String *fields;
+    int count;
+} CsvRow;
+
+typedef usize (*CsvReadFn)(void *user, u8 *buf, usize cap);
+
+// Rows are returned one at a time. In string mode fields live as long as the
+// input (and the arena, for unescaped ones); in streaming mode they are valid
+// until the next call. Blank lines are skipped.
+typedef struct {
+    Allocator *alloc;
+    Arena *arena;       // string mode: unescaped fields go here
+    CsvReadFn read;
+    void *user;
+    u8 *buf;
+    usize cap;
+    usize len;
+    usize base;         // stream offset of buf[0]
+    bool eof;
+    bool owns_buf;
+    u8 delim;
+    // Scanner state, relative to the current row start
+    usize row;          // offset of the row being read
+    usize scan;         // next block to classify
+    usize block;        // offset of the block seps came from
+    u64 seps;           // unconsumed separators outside quotes
+    u64 newlines;       // the newline subset of seps
+    u64 in_quote;       // all ones if the last block ended inside quotes
+    u64 block_quotes;   // quote mask of that block
+    bool row_quoted;    // a block touched by this row has a quote
+    String *fields;
+    int field_cap;
+    char *scratch;      // streaming mode: unescaped fields
+    usize scratch_cap;
+    CsvResult error;
+    usize error_offset;
+} CsvReader;
+
+static CsvReader _csv_reader(Allocator *alloc, char delim) {
+    CsvReader r = {0};
+    r.alloc = alloc;
+    r.delim = (u8)delim;
+    r.field_cap = 16;
+    r.fields = (String*)alloc->alloc(alloc, r.field_cap * sizeof(String));
+    if (!r.fields) r.error = CsvErrorMemory;
+    return r;
+}
+
+// Streams rows out of read() through a window of the given size (64K if 0).
+// The window grows when a single row doesn't fit.
+static CsvReader csv_reader_init(Allocator *alloc, CsvReadFn read, void *user, usize window, char delim) {
+    CsvReader r = _csv_reader(alloc, delim);
+    r.read = read;
+    r.user = user;
+    r.cap = window ? window : KB(64);
+    r.buf = (u8*)alloc->alloc(alloc, r.cap);
+    r.owns_buf = true;
+    if (!r.buf) r.error = CsvErrorMemory;
+    return r;
+}
+
+// Reads rows straight out of an in-memory buffer
+static CsvReader csv_reader_init_string(Arena *arena, String input, char delim) {
+    CsvReader r = _csv_reader(&arena->allocator, delim);
+    r.arena = arena;
+    r.buf = (u8*)input.data;
+    r.cap = r.len = input.len;
+    r.eof = true;
+    return r;
+}
+
+static void csv_reader_deinit(CsvReader *r) {
+    if (r->alloc->free) {
+        if (r->owns_buf && r->buf) r->alloc->free(r->alloc, r->buf);
+        if (r->scratch) r->alloc->free(r->alloc, r->scratch);
+        if (r->fields) r->alloc->free(r->alloc, r->fields);
+    }
+    r->buf = NULL;
+    r->scratch = NULL;
+    r->fields = NULL;
+}
+
+// CsvReadFn over a File opened with file_open
+static usize csv_read_file(void *user, u8 *buf, usize cap) {
+    File *f = (File*)user;
+    return fread(buf, 1, cap, f->fd);
+}
+
+static inline u64 _csv_prefix_xor(u64 x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Classifies a 64-byte block into bitmasks, bit i for byte i
+static void _csv_block_masks(const u8 *p, u8 delim, u64 *quote, u64 *sep, u64 *newline) {
+    *quote = *sep = *newline = 0;
+#if SIMD_WIDTH
+    SimdVec v_qt = simd_splat('"');
+    SimdVec v_delim = simd_splat(delim);
+    SimdVec v_lf = simd_splat('\n');
+    for (int k = 0; k < 64; k += SIMD_WIDTH) {
+        SimdVec v = simd_load(p + k);
+        *quote |= (u64)simd_mask(simd_eq(v, v_qt)) << k;
+        *sep |= (u64)simd_mask(simd_eq(v, v_delim)) << k;
+        *newline |= (u64)simd_mask(simd_eq(v, v_lf)) << k;
+    }
+#else
+    for (int k = 0; k < 64; ++k) {
+        u64 bit = (u64)1 << k;
+        if (p[k] == '"') *quote |= bit;
+        if (p[k] == delim) *sep |= bit;
+        if (p[k] == '\n') *newline |= bit;
+    }
+#endif
+    *sep |= *newline;
+}
+
+typedef enum {
+    _CsvSep,
+    _CsvEnd,    // no more input
+    _CsvMore,   // the window needs refilling before the next block
+} _CsvScan;
+
+// Finds the next delimiter or newline outside quotes
+static _CsvScan _csv_next_sep(CsvReader *r, usize *at, bool *newline) {
+    while (!r->seps) {
+        if (r->scan >= r->len) return r->eof ? _CsvEnd : _CsvMore;
+
+        const u8 *block = r->buf + r->scan;
+        u64 valid = ~(u64)0;
+        u8 pad[64];
+        if (r->scan + 64 > r->len) {
+            // Only the true end of input may be classified in a partial block
+            if (!r->eof) return _CsvMore;
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, block, r->len - r->scan);
+            block = pad;
+            valid = ((u64)1 << (r->len - r->scan)) - 1;
+        }
+
+        u64 quote, sep, nl;
+        _csv_block_masks(block, r->delim, &quote, &sep, &nl);
+        // Doubled quotes toggle twice, so they never leave the quoted region
+        u64 quoted = _csv_prefix_xor(quote) ^ r->in_quote;
+        r->in_quote = (u64)((i64)quoted >> 63);
+        r->block_quotes = quote;
+        r->row_quoted |= quote != 0;
+        r->seps = sep & ~quoted & valid;
+        r->newlines = nl & ~quoted & valid;
+        r->block = r->scan;
+        r->scan += 64;
+    }
+
+    int bit = bit_first(r->seps);
+    *at = r->block + bit;
+    *newline = (r->newlines >> bit) & 1;
+    r->seps &= r->seps - 1;
+    return _CsvSep;
+}
+
+// Compacts the window down to the current row and reads more input. The row is
+// rescanned from its start afterwards.
+static bool _csv_refill(CsvReader *r) {
+    if (r->row) {
+        memmove(r->buf, r->buf + r->row, r->len - r->row);
+        r->len -= r->row;
+        r->base += r->row;
+        r->row = 0;
+    }
+    if (r->len == r->cap) {
+        u8 *buf = (u8*)r->alloc->realloc(r->alloc, r->buf, r->cap * 2);
+        if (!buf) return false;
+        r->buf = buf;
+        r->cap *= 2;
+    }
+    while (r->len < r->cap && !r->eof) {
+        usize got = r->read(r->user, r->buf + r->len, r->cap - r->len);
+        if (got == 0) r->eof = true;
+        r->len += got;
+    }
+
+    r->scan = r->row;
+    r->seps = r->newlines = r->in_quote = r->block_quotes = 0;
+    r->row_quoted = false;
+    return true;
+}
+
+static bool _csv_fail(CsvReader *r, CsvResult error, usize offset) {
+    r->error = error;
+    r->error_offset = r->base + offset;
+    return false;
+}
+
+static char *_csv_unescape_buf(CsvReader *r, usize size) {
+    if (r->arena) return (char*)arena_alloc(r->arena, size);
+    if (size > r->scratch_cap) {
+        char *scratch = (char*)r->alloc->realloc(r->alloc, r->scratch, size);
+        if (!scratch) return NULL;
+        r->scratch = scratch;
+        r->scratch_cap = size;
+    }
+    return r->scratch;
+}
+
+// Strips the quotes from the fields of a complete row and collapses doubled
+// quotes. Only runs when the row's blocks contained a quote at all.
+static bool _csv_unquote_row(CsvReader *r, int count) {
+    usize escaped = 0;
+    for (int i = 0; i < count; ++i) {
+        String f = r->fields[i];
+        usize offset = (u8*)f.data - r->buf;
+        if (f.len == 0 || f.data[0] != '"') {
+            int q = string_find_char(f, '"');
+            if (q >= 0) return _csv_fail(r, CsvErrorQuote, offset + q);
+            continue;
+        }
+        if (f.len < 2 || f.data[f.len - 1] != '"')
+            return _csv_fail(r, CsvErrorQuote, offset);
+
+        String inner = string_slice(f, 1, f.len - 1);
+        r->fields[i] = inner;
+        if (string_find_char(inner, '"') >= 0) escaped += inner.len;
+    }
+    if (!escaped) return true;
+
+    char *out = _csv_unescape_buf(r, escaped);
+    if (!out) return _csv_fail(r, CsvErrorMemory, r->row);
+
+    for (int i = 0; i < count; ++i) {
+        String f = r->fields[i];
+        int q = string_find_char(f, '"');
+        if (q < 0) continue;
+
+        char *dst = out;
+        for (int k = 0; k < f.len; ++k) {
+            if (f.data[k] == '"') {
+                // The prefix xor only guarantees quotes come in pairs overall
+                if (k + 1 >= f.len || f.data[k + 1] != '"')
+                    return _csv_fail(r, CsvErrorQuote, (u8*)f.data - r->buf + k);
+                k++;
+            }
+            *dst++ = f.data[k];
+        }
+        r->fields[i] = (String){.data = out, .len = (int)(dst - out)};
+        out = dst;
+    }
+    return true;
+}
+
+// Reads the next row into row. Returns false at the end of input or on error;
+// check r->error to tell them apart.
+static bool csv_reader_next(CsvReader *r, CsvRow *row) {
+    if (r->error) return false;
+
+    for (;;) {
+        int count = 0;
+        usize field_start = r->row;
+        bool row_done = false;
+        bool more = false;
+
+        while (!row_done) {
+            usize at;
+            bool newline = false;
+            _CsvScan s = _csv_next_sep(r, &at, &newline);
+            if (s == _CsvMore) {
+                more = true;
+                break;
+            }
+            bool lf = newline;  // only a real '\n' can have a '\r' before it
+            if (s == _CsvEnd) {
+                if (r->row >= r->len) return false;
+                if (r->in_quote) return _csv_fail(r, CsvErrorQuote, r->row);
+                at = r->len;
+                newline = true;
+            }
+
+            if (count == r->field_cap) {
+                String *fields = (String*)r->alloc->realloc(r->alloc, r->fields, r->field_cap * 2 * sizeof(String));
+                if (!fields) return _csv_fail(r, CsvErrorMemory, field_start);
+                r->fields = fields;
+                r->field_cap *= 2;
+            }
+
+            usize end = at;
+            if (lf && end > field_start && r->buf[end - 1] == '\r') end--;
+            r->fields[count++] = (String){
+                .data = (char*)r->buf + field_start,
+                .len = (int)(end - field_start),
+            };
+            field_start = at + 1;
+            row_done = newline;
+        }
+
+        if (more) {
+            if (!_csv_refill(r)) return _csv_fail(r, CsvErrorMemory, r->row);
+            continue;
+        }
+
+        bool quoted = r->row_quoted;
+        r->row = field_start;
+        // The next row starts in the current block, or the one after it
+        r->row_quoted = r->block_quotes != 0;
+        if (count == 1 && r->fields[0].len == 0) continue;
+
+        if (quoted && !_csv_unquote_row(r, count)) return false;
+
+        row->fields = r->fields;
+        row->count = count;
+        return true;
+    }
+}
+
+/* COLUMNS */
+
+// Column-major view of a whole file: columns[c][r] is field c of row r
+typedef struct {
+    String *names;      // header row when requested, otherwise NULL
+    String **columns;
+    int column_count;
+    usize row_count;
+} CsvColumns;
+
+// Parses all of input into columns allocated in arena. Every row must have as
+// many fields as the first one.
+static CsvResult csv_read_columns(Arena *arena, String input, char delim, bool header, CsvColumns *out) {
+    *out = (CsvColumns){0};
+    LibCAllocator heap = heap_allocator_init();
+    Array(String) cells;
+    array_init_capacity(&heap.allocator, &cells, 1024);
+    if (!cells.items) return CsvErrorMemory;
+
+    CsvReader r = csv_reader_init_string(arena, input, delim);
+    CsvRow row;
+    CsvResult result = CsvOk;
+    while (csv_reader_next(&r, &row)) {
+        if (out->column_count == 0) out->column_count = row.count;
+        if (row.count != out->column_count) {
+            result = CsvErrorFieldCount;
+            break;
+        }
+        if (cells.len + row.count > cells.cap) {
+            usize cap = cells.cap * 2;
+            while (cap < cells.len + row.count) cap *= 2;
+            array_reserve(&heap.allocator, &cells, cap);
+            if (!cells.items) {
+                result = CsvErrorMemory;
+                break;
+            }
+        }
+        memcpy(cells.items + cells.len, row.fields, row.count * sizeof(String));
+        cells.len += row.count;
+    }
+    if (r.error) result = r.error;
+    csv_reader_deinit(&r);
+
+    if (result == CsvOk && out->column_count) {
+        int cols = out->column_count;
+        usize rows = cells.len / cols;
+        String *data = cells.items;
+        if (header) {
+            out->names = (String*)arena_alloc(arena, cols * sizeof(String));
+            if (out->names) memcpy(out->names, data, cols * sizeof(String));
+            data += cols;
+            rows--;
+        }
+
+        out->row_count = rows;
+        out->columns = (String**)arena_alloc(arena, cols * sizeof(String*));
+        String *flat = (String*)arena_alloc(arena, (rows ? rows : 1) * cols * sizeof(String));
+        if (!out->columns || !flat || (header && !out->names)) {
+            result = CsvErrorMemory;
+        } else {
+            for (int c = 0; c < cols; ++c) {
+                out->columns[c] = flat + c * rows;
+                for (usize i = 0; i < rows; ++i) out->columns[c][i] = data[i * cols + c];
+            }
+        }
+    }
+
+    heap.allocator.free(&heap.allocator, cells.items);
+    return result;
+}
+
+#endif
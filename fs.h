@@ -8,19 +8,33 @@
 
 #include <stdio.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 
 typedef u32 FileType;
 enum FileTypes {
     FileType_Invalid,
     FileType_File,
     FileType_Dir,
+    FileType_Link,  // symbolic link, not followed
 };
 
 typedef u32 FileOpenFlag;
 enum FileOpenFlags {
     FileOpen_ReadOnly = 1 << 0,
     FileOpen_Binary = 1 << 1,
+    FileOpen_Append = 1 << 2,   // writes go to the end, existing contents kept
 };
 
 typedef struct {
@@ -28,21 +42,26 @@ typedef struct {
     usize size;
 } File;
 
-// Opens a file from a path, with write permissions
+// Opens a file from a path, with write permissions unless ReadOnly is set.
+// fd is NULL on failure.
 static File file_open(const char *path, FileOpenFlag flags) {
     char *mode;
     if (flags & FileOpen_ReadOnly)
-        mode = "r";
+        mode = flags & FileOpen_Binary ? "rb" : "r";
+    else if (flags & FileOpen_Append)
+        mode = flags & FileOpen_Binary ? "a+b" : "a+";
     else 
-        mode = "w+";
-    
-    // TODO handle append write
+        mode = flags & FileOpen_Binary ? "w+b" : "w+";
 
     FILE *fd = fopen(path, mode);
+    if (!fd) {
+        return (File){0};
+    }
+
+    struct stat st;
     usize len = 0;
-    fseek(fd, 0, SEEK_END);
-    len = (usize)ftell(fd);
-    fseek(fd, 0, SEEK_SET);
+    if (fstat(fileno(fd), &st) == 0)
+        len = (usize)st.st_size;
     
     return (File){.fd = fd, .size = len};
 }
@@ -73,14 +92,822 @@ static void file_close(File f) {
     fclose(f.fd);
 }
 
+/* FILE DESCRIPTORS */
+
+// Unbuffered file on a raw descriptor. Reads and writes take explicit offsets
+// and never move a shared file position, so any number of threads can use one
+// FileHandle at once.
+typedef struct {
+    int fd;     // -1 when not open
+    usize size; // at open time, see file_handle_size
+} FileHandle;
+
+static int _file_open_flags(FileOpenFlag flags) {
+    int oflags = O_CLOEXEC;
+    if (flags & FileOpen_ReadOnly)
+        oflags |= O_RDONLY;
+    else if (flags & FileOpen_Append)
+        oflags |= O_RDWR | O_CREAT | O_APPEND;
+    else
+        oflags |= O_RDWR | O_CREAT | O_TRUNC;
+    return oflags;
+}
+
+// Opens path relative to the directory dir_fd (AT_FDCWD for the working
+// directory), with the same flag meanings as file_open
+static FileHandle file_handle_openat(int dir_fd, const char *path, FileOpenFlag flags) {
+    FileHandle f = {.fd = -1};
+    int fd;
+    do {
+        fd = openat(dir_fd, path, _file_open_flags(flags), 0644);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) return f;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return f;
+    }
+    f.fd = fd;
+    f.size = (usize)st.st_size;
+    return f;
+}
+
+static FileHandle file_handle_open(const char *path, FileOpenFlag flags) {
+    return file_handle_openat(AT_FDCWD, path, flags);
+}
+
+// Current size, refreshed through fstat
+static usize file_handle_size(FileHandle *f) {
+    struct stat st;
+    if (fstat(f->fd, &st) == 0) f->size = (usize)st.st_size;
+    return f->size;
+}
+
+// Reads up to len bytes at offset, retrying short reads. Returns the number of
+// bytes read (less than len only at end of file), or -1 on error.
+static isize file_pread(FileHandle f, void *buf, usize len, u64 offset) {
+    usize done = 0;
+    while (done < len) {
+        ssize_t n = pread(f.fd, (u8*)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += (usize)n;
+    }
+    return (isize)done;
+}
+
+// Writes all of buf at offset. With FileOpen_Append the offset is ignored and
+// the data goes to the end of the file.
+static bool file_pwrite(FileHandle f, const void *buf, usize len, u64 offset) {
+    usize done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(f.fd, (const u8*)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        done += (usize)n;
+    }
+    return true;
+}
+
+// Appends buf at the current end of a file opened with FileOpen_Append
+static bool file_handle_append(FileHandle f, const void *buf, usize len) {
+    usize done = 0;
+    while (done < len) {
+        ssize_t n = write(f.fd, (const u8*)buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        done += (usize)n;
+    }
+    return true;
+}
+
+static u8 *file_handle_read_full_alloc(FileHandle f, Allocator *alloc) {
+    u8 *buf = (u8*)alloc->alloc(alloc, f.size ? f.size : 1);
+    if (!buf) return NULL;
+    if (file_pread(f, buf, f.size, 0) != (isize)f.size) {
+        if (alloc->free) alloc->free(alloc, buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static void file_handle_close(FileHandle *f) {
+    if (f->fd >= 0) close(f->fd);
+    *f = (FileHandle){.fd = -1};
+}
+
+/* STREAMING READER */
+
+#define FILE_READER_CHUNK MB(1)
+
+// Reads a file or pipe front to back in fixed-size chunks through two reusable
+// page-aligned buffers, so memory stays constant whatever the input size. A
+// chunk stays valid until the call after the one that returned it.
+typedef struct {
+    Allocator *alloc;
+    int fd;
+    bool owns_fd;
+    usize chunk;        // bytes requested per read
+    u8 *raw[2];         // allocations backing buf
+    u8 *buf[2];
+    usize cap[2];
+    int cur;
+    const u8 *carry;    // unfinished line left over from the last chunk
+    usize carry_len;
+    u64 offset;         // bytes consumed from fd so far
+    bool eof;
+    bool error;
+} FileReader;
+
+// Grows buffer i to hold size bytes, keeping its first keep bytes
+static bool _file_reader_reserve(FileReader *r, int i, usize size, usize keep) {
+    if (size <= r->cap[i]) return true;
+    usize page = (usize)sysconf(_SC_PAGESIZE);
+    usize cap = r->cap[i] ? r->cap[i] * 2 : r->chunk;
+    while (cap < size) cap *= 2;
+    u8 *raw = (u8*)r->alloc->alloc(r->alloc, cap + page);
+    if (!raw) {
+        err("Allocation failed\n");
+        r->error = true;
+        return false;
+    }
+    u8 *buf = (u8*)align_forward((usize)raw, (int)page);
+    if (keep) memcpy(buf, r->buf[i], keep);
+    if (r->alloc->free && r->raw[i]) r->alloc->free(r->alloc, r->raw[i]);
+    r->raw[i] = raw;
+    r->buf[i] = buf;
+    r->cap[i] = cap;
+    return true;
+}
+
+// Streams from an open descriptor. chunk is rounded up to whole pages (1MiB if
+// 0). The descriptor is left open by file_reader_close.
+static FileReader file_reader_init_fd(Allocator *alloc, int fd, usize chunk) {
+    FileReader r = {.alloc = alloc, .fd = fd};
+    usize page = (usize)sysconf(_SC_PAGESIZE);
+    if (!chunk) chunk = FILE_READER_CHUNK;
+    r.chunk = (chunk + page - 1) & ~(page - 1);
+    // Fails harmlessly with ESPIPE on pipes
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return r;
+}
+
+static FileReader file_reader_open(Allocator *alloc, const char *path, usize chunk) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err("Failed to open %s: %s\n", path, strerror(errno));
+        return (FileReader){.fd = -1, .error = true};
+    }
+    FileReader r = file_reader_init_fd(alloc, fd, chunk);
+    r.owns_fd = true;
+    return r;
+}
+
+// Fills dst with up to len bytes, only stopping short at end of input
+static usize _file_reader_fill(FileReader *r, u8 *dst, usize len) {
+    usize done = 0;
+    while (done < len) {
+        ssize_t n = read(r->fd, dst + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            r->error = true;
+            break;
+        }
+        if (n == 0) {
+            r->eof = true;
+            break;
+        }
+        done += (usize)n;
+    }
+    r->offset += done;
+    // Start pulling the next chunk into the page cache while this one is used
+    if (!r->eof) posix_fadvise(r->fd, (off_t)r->offset, (off_t)r->chunk, POSIX_FADV_WILLNEED);
+    return done;
+}
+
+// Next chunk of up to chunk bytes at arbitrary boundaries. Returns false at the
+// end of input or on error.
+static bool file_reader_next(FileReader *r, String *out) {
+    if (r->eof || r->error) return false;
+    r->cur ^= 1;
+    if (!_file_reader_reserve(r, r->cur, r->chunk, 0)) return false;
+    usize got = _file_reader_fill(r, r->buf[r->cur], r->chunk);
+    if (got == 0) return false;
+    *out = (String){.data = (char*)r->buf[r->cur], .len = (int)got};
+    return true;
+}
+
+// Next run of whole lines, ending just after a '\n' (or at end of input), for
+// line_iter or the CSV reader. A partial line at the end of a chunk is carried
+// to the front of the next one; a line longer than a chunk grows the buffer.
+static bool file_reader_next_lines(FileReader *r, String *out) {
+    if (r->error) return false;
+    if (r->eof) {
+        if (!r->carry_len) return false;
+        *out = (String){.data = (char*)r->carry, .len = (int)r->carry_len};
+        r->carry_len = 0;
+        return true;
+    }
+
+    r->cur ^= 1;
+    int i = r->cur;
+    // The carry lives in the other buffer
+    if (!_file_reader_reserve(r, i, r->carry_len + r->chunk, 0)) return false;
+    if (r->carry_len) memcpy(r->buf[i], r->carry, r->carry_len);
+    usize len = r->carry_len;
+    usize scanned = len;
+
+    for (;;) {
+        if (!_file_reader_reserve(r, i, len + r->chunk, len)) return false;
+        len += _file_reader_fill(r, r->buf[i] + len, r->chunk);
+        if (r->error) return false;
+
+        int nl = string_find_last_char((String){(char*)r->buf[i] + scanned, (int)(len - scanned)}, '\n');
+        if (nl >= 0) {
+            usize end = scanned + nl + 1;
+            r->carry = r->buf[i] + end;
+            r->carry_len = len - end;
+            *out = (String){.data = (char*)r->buf[i], .len = (int)end};
+            return true;
+        }
+        if (r->eof) {
+            r->carry_len = 0;
+            if (!len) return false;
+            *out = (String){.data = (char*)r->buf[i], .len = (int)len};
+            return true;
+        }
+        scanned = len;
+    }
+}
+
+// CsvReadFn/JsonReadFn over the reader's descriptor: reads straight into the
+// caller's window, keeping the sequential readahead hints. Don't mix with
+// file_reader_next on the same reader.
+static usize file_reader_read(void *user, u8 *buf, usize cap) {
+    FileReader *r = (FileReader*)user;
+    if (r->eof || r->error) return 0;
+    return _file_reader_fill(r, buf, cap);
+}
+
+static void file_reader_close(FileReader *r) {
+    if (r->alloc && r->alloc->free) {
+        if (r->raw[0]) r->alloc->free(r->alloc, r->raw[0]);
+        if (r->raw[1]) r->alloc->free(r->alloc, r->raw[1]);
+    }
+    if (r->owns_fd && r->fd >= 0) close(r->fd);
+    *r = (FileReader){.fd = -1};
+}
+
+/* BUFFERED WRITER */
+
+#define FILE_WRITER_BUFFER MB(1)
+// Appends at least this large are written straight from the caller's memory
+#define FILE_WRITER_DIRECT KB(64)
+
+typedef u32 FileWriterFlag;
+enum FileWriterFlags {
+    FileWriter_Background = 1 << 0, // write full buffers from a flush thread
+};
+
+// Coalesces appends in a large buffer and writes it out in few syscalls. Safe
+// to share between threads. With FileWriter_Background a full buffer goes to
+// a flush thread while appends continue into a second one. file_writer_sync
+// is a group commit: callers that arrive while an fdatasync is running share
+// the next one instead of each syncing. Must not move once initialized.
+typedef struct {
+    Allocator *alloc;
+    int fd;
+    bool owns_fd;
+    pthread_mutex_t lock;
+    pthread_cond_t done;    // a flush or sync finished
+    u8 *buf[2];
+    usize cap;
+    usize len;              // bytes in buf[cur]
+    int cur;
+    u64 appended;           // total bytes accepted
+    u64 flushed;            // total bytes handed to the kernel
+    u64 synced;             // total bytes known durable
+    bool syncing;
+    bool error;
+    // Background flushing
+    bool background;
+    pthread_t thread;
+    pthread_cond_t work;
+    u8 *pending;            // buffer being written by the thread
+    usize pending_len;
+    bool stop;
+} FileWriter;
+
+// Writes every byte described by iov, resuming after short writes
+static bool _file_writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (count > 0 && (usize)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (u8*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+static void *_file_writer_thread(void *arg) {
+    FileWriter *w = (FileWriter*)arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->pending && !w->stop) pthread_cond_wait(&w->work, &w->lock);
+        if (!w->pending) break;
+
+        struct iovec iov = {w->pending, w->pending_len};
+        usize n = w->pending_len;
+        pthread_mutex_unlock(&w->lock);
+        bool ok = _file_writev_all(w->fd, &iov, 1);
+        pthread_mutex_lock(&w->lock);
+
+        if (!ok) w->error = true;
+        w->flushed += n;
+        w->pending = NULL;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Lock held. Waits for the flush thread to finish its current buffer.
+static void _file_writer_wait_idle(FileWriter *w) {
+    while (w->pending) pthread_cond_wait(&w->done, &w->lock);
+}
+
+// Lock held. Pushes out the current buffer, together with extra (may be NULL)
+// in the same writev when writing inline.
+static void _file_writer_flush_locked(FileWriter *w, const void *extra, usize extra_len) {
+    if (w->background) {
+        if (w->len) {
+            _file_writer_wait_idle(w);
+            w->pending = w->buf[w->cur];
+            w->pending_len = w->len;
+            w->cur ^= 1;
+            w->len = 0;
+            pthread_cond_signal(&w->work);
+        }
+        if (!extra_len) return;
+        // Direct writes must land after everything queued before them
+        _file_writer_wait_idle(w);
+    }
+
+    struct iovec iov[2];
+    int count = 0;
+    if (w->len) iov[count++] = (struct iovec){w->buf[w->cur], w->len};
+    if (extra_len) iov[count++] = (struct iovec){(void*)extra, extra_len};
+    if (!count) return;
+    if (!_file_writev_all(w->fd, iov, count)) w->error = true;
+    w->flushed += w->len + extra_len;
+    w->len = 0;
+}
+
+// Takes over fd, unless this fails. cap is the size of each buffer (1MiB if 0).
+static bool file_writer_init(FileWriter *w, Allocator *alloc, int fd, usize cap, FileWriterFlag flags) {
+    memset(w, 0, sizeof(*w));
+    w->alloc = alloc;
+    w->fd = fd;
+    w->owns_fd = true;
+    w->cap = cap ? cap : FILE_WRITER_BUFFER;
+    w->background = (flags & FileWriter_Background) != 0;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->done, NULL);
+    pthread_cond_init(&w->work, NULL);
+
+    w->buf[0] = (u8*)alloc->alloc(alloc, w->cap);
+    if (w->background) w->buf[1] = (u8*)alloc->alloc(alloc, w->cap);
+    if (!w->buf[0] || (w->background && !w->buf[1])) {
+        err("Allocation failed\n");
+        if (alloc->free) {
+            if (w->buf[0]) alloc->free(alloc, w->buf[0]);
+            if (w->buf[1]) alloc->free(alloc, w->buf[1]);
+        }
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->done);
+        pthread_cond_destroy(&w->work);
+        memset(w, 0, sizeof(*w));
+        w->fd = -1;
+        return false;
+    }
+    if (w->background && pthread_create(&w->thread, NULL, _file_writer_thread, w) != 0) {
+        err("Failed to start flush thread\n");
+        w->background = false;
+    }
+    return true;
+}
+
+static bool file_writer_open(FileWriter *w, Allocator *alloc, const char *path, FileOpenFlag open_flags, usize cap, FileWriterFlag flags) {
+    FileHandle f = file_handle_open(path, open_flags & ~FileOpen_ReadOnly);
+    if (f.fd < 0) {
+        err("Failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (file_writer_init(w, alloc, f.fd, cap, flags)) return true;
+    file_handle_close(&f);
+    return false;
+}
+
+// Appends all parts in order. Small parts are copied into the buffer, large
+// ones (or any that wouldn't fit in it) are written from the caller's memory
+// in one writev with the buffer.
+static bool file_writer_appendv(FileWriter *w, const String *parts, int count) {
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < count; ++i) {
+        String s = parts[i];
+        if ((usize)s.len >= FILE_WRITER_DIRECT || (usize)s.len > w->cap) {
+            _file_writer_flush_locked(w, s.data, s.len);
+        } else {
+            if (w->len + s.len > w->cap) _file_writer_flush_locked(w, NULL, 0);
+            memcpy(w->buf[w->cur] + w->len, s.data, s.len);
+            w->len += s.len;
+        }
+        w->appended += s.len;
+    }
+    bool ok = !w->error;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+static bool file_writer_append(FileWriter *w, String s) {
+    return file_writer_appendv(w, &s, 1);
+}
+
+// Hands everything appended so far to the kernel
+static bool file_writer_flush(FileWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    _file_writer_flush_locked(w, NULL, 0);
+    if (w->background) _file_writer_wait_idle(w);
+    bool ok = !w->error;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// Returns once everything appended before the call is on stable storage
+static bool file_writer_sync(FileWriter *w) {
+    pthread_mutex_lock(&w->lock);
+    u64 target = w->appended;
+    _file_writer_flush_locked(w, NULL, 0);
+    if (w->background) _file_writer_wait_idle(w);
+
+    while (w->synced < target && !w->error) {
+        if (w->syncing) {
+            pthread_cond_wait(&w->done, &w->lock);
+            continue;
+        }
+        // Leader: one fdatasync covers every writer flushed so far
+        w->syncing = true;
+        u64 upto = w->flushed;
+        pthread_mutex_unlock(&w->lock);
+        int r;
+        do {
+            r = fdatasync(w->fd);
+        } while (r != 0 && errno == EINTR);
+        pthread_mutex_lock(&w->lock);
+        w->syncing = false;
+        if (r != 0) w->error = true;
+        else if (upto > w->synced) w->synced = upto;
+        pthread_cond_broadcast(&w->done);
+    }
+    bool ok = !w->error;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// Flushes, stops the flush thread and closes the descriptor
+static bool file_writer_close(FileWriter *w) {
+    bool ok = file_writer_flush(w);
+    if (w->background) {
+        pthread_mutex_lock(&w->lock);
+        w->stop = true;
+        pthread_cond_signal(&w->work);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+    }
+    if (w->owns_fd && w->fd >= 0 && close(w->fd) != 0) ok = false;
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->work);
+    if (w->alloc->free) {
+        if (w->buf[0]) w->alloc->free(w->alloc, w->buf[0]);
+        if (w->buf[1]) w->alloc->free(w->alloc, w->buf[1]);
+    }
+    w->fd = -1;
+    w->buf[0] = w->buf[1] = NULL;
+    return ok;
+}
+
+/* ZERO-COPY TRANSFER */
+
+#define FILE_COPY_BUFFER MB(1)
+
+#ifdef __linux__
+// From linux/fs.h and fcntl.h, which need _GNU_SOURCE or clash with libc
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_MORE 4
+#endif
+#endif
+
+// Copies up to len bytes at offset through a buffer. out_offset < 0 writes at
+// the descriptor's position, as sockets need. Returns the bytes written, or
+// -1 if the first read or write failed.
+static isize _file_copy_buffered(int in_fd, u64 offset, int out_fd, i64 out_offset, usize len) {
+    LibCAllocator heap = heap_allocator_init();
+    usize cap = len < FILE_COPY_BUFFER ? len : FILE_COPY_BUFFER;
+    u8 *buf = (u8*)heap.allocator.alloc(&heap.allocator, cap ? cap : 1);
+    if (!buf) return -1;
+
+    usize done = 0;
+    bool failed = false;
+    while (done < len && !failed) {
+        usize want = len - done < cap ? len - done : cap;
+        isize n = file_pread((FileHandle){.fd = in_fd}, buf, want, offset + done);
+        if (n <= 0) {
+            failed = n < 0;
+            break;
+        }
+        usize written = 0;
+        while (written < (usize)n) {
+            ssize_t w = out_offset >= 0
+                ? pwrite(out_fd, buf + written, (usize)n - written, (off_t)((u64)out_offset + done + written))
+                : write(out_fd, buf + written, (usize)n - written);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                failed = true;
+                break;
+            }
+            written += (usize)w;
+        }
+        done += written;
+        if ((usize)n < want) break;
+    }
+    int saved = errno;
+    heap.allocator.free(&heap.allocator, buf);
+    errno = saved;
+    return failed && done == 0 ? -1 : (isize)done;
+}
+
+// Copies len bytes from in at in_offset to out at out_offset inside the
+// kernel with copy_file_range, which filesystems may turn into a server-side
+// copy or shared extents. Falls back to a buffer loop across filesystems or
+// where the call is missing. Returns the bytes copied, fewer at end of file,
+// or -1 on error.
+static isize file_copy_range(FileHandle in, FileHandle out, u64 in_offset, u64 out_offset, usize len) {
+    usize done = 0;
+#ifdef __linux__
+    while (done < len) {
+        loff_t in_off = (loff_t)(in_offset + done), out_off = (loff_t)(out_offset + done);
+        long n = syscall(SYS_copy_file_range, in.fd, &in_off, out.fd, &out_off, len - done, 0u);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) break;
+        if (n < 0) return done ? (isize)done : -1;
+        if (n == 0) return (isize)done;
+        done += (usize)n;
+    }
+#endif
+    if (done < len) {
+        isize n = _file_copy_buffered(in.fd, in_offset + done, out.fd, (i64)(out_offset + done), len - done);
+        if (n < 0) return done ? (isize)done : -1;
+        done += (usize)n;
+    }
+    return (isize)done;
+}
+
+// Copies the file at src to dst, replacing it, with src's permissions. Where
+// the filesystem supports reflinks (Btrfs, XFS, bcachefs) dst shares src's
+// extents and nothing is copied until either is written.
+static bool file_copy(const char *src, const char *dst) {
+    FileHandle in = file_handle_open(src, FileOpen_ReadOnly);
+    if (in.fd < 0) {
+        err("Failed to open %s: %s\n", src, strerror(errno));
+        return false;
+    }
+    struct stat in_st, out_st;
+    if (fstat(in.fd, &in_st) != 0) {
+        err("Failed to stat %s: %s\n", src, strerror(errno));
+        file_handle_close(&in);
+        return false;
+    }
+    // Not truncated until we know dst isn't src under another name
+    FileHandle out = {.fd = open(dst, O_WRONLY | O_CREAT | O_CLOEXEC, in_st.st_mode & 0777)};
+    if (out.fd < 0 || fstat(out.fd, &out_st) != 0) {
+        err("Failed to open %s: %s\n", dst, strerror(errno));
+        file_handle_close(&in);
+        file_handle_close(&out);
+        return false;
+    }
+    if (in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+        err("Failed to copy %s: destination is the source\n", src);
+        file_handle_close(&in);
+        file_handle_close(&out);
+        return false;
+    }
+
+    // open only applies the mode to a file it creates
+    bool ok = fchmod(out.fd, in_st.st_mode & 0777) == 0 && ftruncate(out.fd, 0) == 0;
+#ifdef __linux__
+    bool cloned = ok && ioctl(out.fd, FICLONE, in.fd) == 0;
+#else
+    bool cloned = false;
+#endif
+    if (ok && !cloned) ok = file_copy_range(in, out, 0, 0, in.size) == (isize)in.size;
+    if (!ok) err("Failed to copy %s to %s: %s\n", src, dst, strerror(errno));
+    file_handle_close(&in);
+    if (close(out.fd) != 0) ok = false;
+    if (!ok) unlink(dst);
+    return ok;
+}
+
+#ifdef __linux__
+// Moves the range through a pipe with splice, for sources sendfile refuses
+static isize _file_splice(int out_fd, FileHandle in, u64 offset, usize len) {
+    int pipe_fds[2];
+    if (syscall(SYS_pipe2, pipe_fds, O_CLOEXEC) != 0) return -1;
+    usize done = 0;
+    bool failed = false;
+    while (done < len && !failed) {
+        loff_t off = (loff_t)(offset + done);
+        long in_pipe = syscall(SYS_splice, in.fd, &off, pipe_fds[1], NULL, len - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe < 0 && errno == EINTR) continue;
+        if (in_pipe <= 0) {
+            failed = in_pipe < 0;
+            break;
+        }
+        // Whatever doesn't reach out_fd is dropped with the pipe and read
+        // from the file again by the next call
+        long drained = 0;
+        while (drained < in_pipe) {
+            long n = syscall(SYS_splice, pipe_fds[0], NULL, out_fd, NULL, (usize)(in_pipe - drained), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                failed = true;
+                break;
+            }
+            drained += n;
+        }
+        done += (usize)drained;
+    }
+    int saved = errno;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    errno = saved;
+    return failed && done == 0 ? -1 : (isize)done;
+}
+#endif
+
+// Sends len bytes of in from offset to out_fd, usually a socket, without
+// copying through user space: sendfile, then splice, then a buffer loop.
+// Returns the bytes sent, fewer than len at end of file or when a
+// non-blocking out_fd is full (errno EAGAIN); resume at offset + the result.
+// -1 on error or when nothing could be sent.
+static isize file_send(int out_fd, FileHandle in, u64 offset, usize len) {
+    usize done = 0;
+#ifdef __linux__
+    while (done < len) {
+        off_t off = (off_t)(offset + done);
+        ssize_t n = sendfile(out_fd, in.fd, &off, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            isize rest = _file_splice(out_fd, in, offset + done, len - done);
+            if (rest >= 0) return (isize)(done + (usize)rest);
+            if (errno != EINVAL && errno != ENOSYS) return done ? (isize)done : -1;
+            break;
+        }
+        if (n < 0) return done ? (isize)done : -1;
+        if (n == 0) return (isize)done;
+        done += (usize)n;
+    }
+#endif
+    if (done < len) {
+        isize rest = _file_copy_buffered(in.fd, offset + done, out_fd, -1, len - done);
+        if (rest < 0) return done ? (isize)done : -1;
+        done += (usize)rest;
+    }
+    return (isize)done;
+}
+
+
+/* MEMORY-MAPPED FILES */
+
+typedef u32 FileMapFlag;
+enum FileMapFlags {
+    FileMap_Sequential = 1 << 0,    // read front to back, prefetch aggressively
+    FileMap_Random = 1 << 1,        // no readahead
+    FileMap_WillNeed = 1 << 2,      // start reading the whole range in now
+    FileMap_DontNeed = 1 << 3,      // file_map_advise only: drop consumed pages
+};
+
+// Read-only view of a whole file. The pages are shared with the page cache, so
+// a multi-GB file costs no copy and no memory beyond what is resident.
+typedef struct {
+    u8 *data;
+    usize size;
+    bool ok;
+} FileMap;
+
+static int _file_map_advice(FileMapFlag flags) {
+    if (flags & FileMap_DontNeed) return MADV_DONTNEED;
+    if (flags & FileMap_WillNeed) return MADV_WILLNEED;
+    if (flags & FileMap_Sequential) return MADV_SEQUENTIAL;
+    if (flags & FileMap_Random) return MADV_RANDOM;
+    return MADV_NORMAL;
+}
+
+// Applies flags to [offset, offset + len) of the mapping. Offsets are rounded
+// out to page boundaries.
+static bool file_map_advise(FileMap map, usize offset, usize len, FileMapFlag flags) {
+    if (!map.data || offset >= map.size) return true;
+    if (len > map.size - offset) len = map.size - offset;
+    usize page = (usize)sysconf(_SC_PAGESIZE);
+    usize start = offset & ~(page - 1);
+    len += offset - start;
+    return madvise(map.data + start, len, _file_map_advice(flags)) == 0;
+}
+
+// Maps path read-only. flags are advice for the whole file; Sequential and
+// WillNeed may be combined. An empty file maps to data == NULL with ok set.
+static FileMap file_map(const char *path, FileMapFlag flags) {
+    FileMap map = {0};
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err("Failed to open %s: %s\n", path, strerror(errno));
+        return map;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        err("Failed to stat %s: %s\n", path, strerror(errno));
+        close(fd);
+        return map;
+    }
+    map.size = (usize)st.st_size;
+    if (map.size == 0) {
+        close(fd);
+        map.ok = true;
+        return map;
+    }
+
+    void *data = mmap(NULL, map.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED) {
+        err("Failed to map %s: %s\n", path, strerror(errno));
+        return (FileMap){0};
+    }
+
+    map.data = (u8*)data;
+    map.ok = true;
+    if (flags & (FileMap_Sequential | FileMap_Random))
+        file_map_advise(map, 0, map.size, flags & (FileMap_Sequential | FileMap_Random));
+    if (flags & FileMap_WillNeed)
+        file_map_advise(map, 0, map.size, FileMap_WillNeed);
+    return map;
+}
+
+// The mapping as a String. Views are limited to 2GiB by String's int length;
+// use data and size directly (e.g. with line_iter) for anything larger.
+static String file_map_string(FileMap map) {
+    usize len = map.size < (usize)INT32_MAX ? map.size : (usize)INT32_MAX;
+    return (String){.data = (char*)map.data, .len = (int)len};
+}
+
+static void file_unmap(FileMap *map) {
+    if (map->data) munmap(map->data, map->size);
+    *map = (FileMap){0};
+}
+
 typedef struct DirIterator {
     struct dirent *file_info;
     FileType type;
     bool ok;
 } DirIterator;
 
+// Extension of the file name from its last dot, e.g. ".txt"
 static String file_ext(char *path) {
-    return string_split_after(string(path), '.');
+    return path_ext(string(path));
 }
 
 static DirIterator dir_iter_next(DIR *dir) {
@@ -89,10 +916,12 @@ static DirIterator dir_iter_next(DIR *dir) {
     if (!iter.file_info) {
         return iter;
     }
-    if (iter.file_info->d_type & DT_DIR) {
+    if (iter.file_info->d_type == DT_DIR) {
         iter.type = FileType_Dir;
-    } else if (iter.file_info->d_type & DT_REG) {
+    } else if (iter.file_info->d_type == DT_REG) {
         iter.type = FileType_File;
+    } else if (iter.file_info->d_type == DT_LNK) {
+        iter.type = FileType_Link;
     }
 
     iter.ok = true;
@@ -0,0 +1,343 @@
+#ifndef FUZZY_H
+#define FUZZY_H
+
+// fzf-style fuzzy matching: a pattern matches a candidate when its characters
+// appear in order, and the score rewards matches on word boundaries and in
+// consecutive runs. Lowercase patterns match case-insensitively, a pattern with
+// an uppercase letter matches case-sensitively.
+
+#include "allocator.h"
+#include "log.h"
+#include "simd.h"
+#include "strings.h"
+#include "thread.h"
+#include "types.h"
+
+#define FUZZY_MAX_PATTERN 64
+// Below this many candidates top-K scoring stays on the calling thread
+#define FUZZY_PARALLEL_MIN 4096
+
+#define _FUZZY_SCORE_MATCH 16
+#define _FUZZY_GAP_START (-3)
+#define _FUZZY_GAP_EXTEND (-1)
+#define _FUZZY_BONUS_BOUNDARY 8
+#define _FUZZY_BONUS_WHITE 10
+#define _FUZZY_BONUS_DELIMITER 9
+#define _FUZZY_BONUS_CAMEL 7
+#define _FUZZY_BONUS_NON_WORD 8
+#define _FUZZY_BONUS_CONSECUTIVE 4
+#define _FUZZY_FIRST_CHAR_MULTIPLIER 2
+
+typedef struct {
+    char chars[FUZZY_MAX_PATTERN];
+    int len;
+    bool case_sensitive;
+    u64 mask;
+} FuzzyPattern;
+
+typedef struct {
+    int index;
+    int score;
+} FuzzyMatch;
+
+static inline u8 _fuzzy_lower(u8 c) {
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+// Bit per case-folded character class: letters and digits get their own bit,
+// everything else shares the remaining 28
+static inline u64 _fuzzy_char_bit(u8 c) {
+    c = _fuzzy_lower(c);
+    if (c >= 'a' && c <= 'z') return (u64)1 << (c - 'a');
+    if (c >= '0' && c <= '9') return (u64)1 << (26 + c - '0');
+    return (u64)1 << (36 + c % 28);
+}
+
+// Set of characters in str. A candidate can only match a pattern whose mask is
+// a subset of its own.
+static u64 fuzzy_char_mask(String str) {
+    u64 mask = 0;
+    for (int i = 0; i < str.len; ++i) mask |= _fuzzy_char_bit((u8)str.data[i]);
+    return mask;
+}
+
+// Patterns longer than FUZZY_MAX_PATTERN are truncated
+static FuzzyPattern fuzzy_pattern(String pattern) {
+    FuzzyPattern fp = {0};
+    fp.len = pattern.len < FUZZY_MAX_PATTERN ? pattern.len : FUZZY_MAX_PATTERN;
+    for (int i = 0; i < fp.len; ++i) {
+        u8 c = (u8)pattern.data[i];
+        if (c >= 'A' && c <= 'Z') fp.case_sensitive = true;
+        fp.chars[i] = (char)c;
+    }
+    fp.mask = fuzzy_char_mask((String){fp.chars, fp.len});
+    return fp;
+}
+
+// Offset of the first byte in [from, len) equal to a or b, or -1
+static int _fuzzy_find(const u8 *p, int from, int len, u8 a, u8 b) {
+    int i = from;
+#if SIMD_WIDTH
+    SimdVec va = simd_splat(a);
+    SimdVec vb = simd_splat(b);
+    for (; i + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+        SimdVec v = simd_load(p + i);
+        u32 mask = simd_mask(simd_or(simd_eq(v, va), simd_eq(v, vb)));
+        if (mask) return i + bit_first(mask);
+    }
+#endif
+    for (; i < len; ++i) {
+        if (p[i] == a || p[i] == b) return i;
+    }
+    return -1;
+}
+
+typedef enum {
+    _FuzzyWhite,
+    _FuzzyNonWord,
+    _FuzzyDelimiter,
+    _FuzzyLower,
+    _FuzzyUpper,
+    _FuzzyNumber,
+} _FuzzyClass;
+
+static inline _FuzzyClass _fuzzy_class(u8 c) {
+    if (c >= 'a' && c <= 'z') return _FuzzyLower;
+    if (c >= 'A' && c <= 'Z') return _FuzzyUpper;
+    if (c >= '0' && c <= '9') return _FuzzyNumber;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return _FuzzyWhite;
+    if (c == '/' || c == '\\' || c == ',' || c == ':' || c == ';' || c == '|') return _FuzzyDelimiter;
+    // Bytes of multibyte UTF-8 count as letters
+    if (c >= 0x80) return _FuzzyLower;
+    return _FuzzyNonWord;
+}
+
+static inline int _fuzzy_bonus(_FuzzyClass prev, _FuzzyClass cur) {
+    if (cur > _FuzzyDelimiter) {
+        if (prev == _FuzzyWhite) return _FUZZY_BONUS_WHITE;
+        if (prev == _FuzzyDelimiter) return _FUZZY_BONUS_DELIMITER;
+        if (prev == _FuzzyNonWord) return _FUZZY_BONUS_BOUNDARY;
+        if ((prev == _FuzzyLower && cur == _FuzzyUpper) || (prev != _FuzzyNumber && cur == _FuzzyNumber))
+            return _FUZZY_BONUS_CAMEL;
+        return 0;
+    }
+    if (cur == _FuzzyWhite) return _FUZZY_BONUS_WHITE;
+    return _FUZZY_BONUS_NON_WORD;
+}
+
+// Scores candidate against the pattern. Returns false if it doesn't match.
+// Runs a Smith-Waterman style alignment one candidate byte at a time, keeping
+// a single row per pattern character, so memory stays O(pattern length).
+static bool fuzzy_score(const FuzzyPattern *fp, String candidate, int *score) {
+    if (fp->len == 0) {
+        *score = 0;
+        return true;
+    }
+
+    // Cheap reject: the pattern must occur as a subsequence. This also bounds
+    // the alignment to [first, last] of that occurrence's span.
+    const u8 *text = (const u8*)candidate.data;
+    int first = -1, at = 0;
+    for (int j = 0; j < fp->len; ++j) {
+        u8 c = (u8)fp->chars[j];
+        u8 alt = fp->case_sensitive ? c : (c >= 'a' && c <= 'z' ? c - 32 : c);
+        at = _fuzzy_find(text, at, candidate.len, c, alt);
+        if (at < 0) return false;
+        if (j == 0) first = at;
+        at++;
+    }
+
+    const int none = INT32_MIN / 2;
+    int h[FUZZY_MAX_PATTERN];       // best score with pattern[0..j] matched so far
+    int run[FUZZY_MAX_PATTERN];     // length of the consecutive run ending in h[j]
+    bool gap[FUZZY_MAX_PATTERN];    // h[j] ended in a gap
+    for (int j = 0; j < fp->len; ++j) {
+        h[j] = none;
+        run[j] = 0;
+        gap[j] = false;
+    }
+
+    int best = none;
+    _FuzzyClass prev = first > 0 ? _fuzzy_class(text[first - 1]) : _FuzzyWhite;
+    for (int i = first; i < candidate.len; ++i) {
+        u8 raw = text[i];
+        u8 c = fp->case_sensitive ? raw : _fuzzy_lower(raw);
+        _FuzzyClass cls = _fuzzy_class(raw);
+        int bonus = _fuzzy_bonus(prev, cls);
+        prev = cls;
+
+        // Descending j so h[j - 1] still holds the previous byte's row
+        for (int j = fp->len - 1; j >= 0; --j) {
+            int skip = h[j] == none ? none : h[j] + (gap[j] ? _FUZZY_GAP_EXTEND : _FUZZY_GAP_START);
+            int take = none, take_run = 0;
+            if ((u8)fp->chars[j] == c) {
+                int diag = j == 0 ? 0 : h[j - 1];
+                if (diag != none) {
+                    take_run = j > 0 && !gap[j - 1] ? run[j - 1] + 1 : 1;
+                    int b = bonus;
+                    if (take_run > 1 && b < _FUZZY_BONUS_CONSECUTIVE) b = _FUZZY_BONUS_CONSECUTIVE;
+                    if (j == 0) b *= _FUZZY_FIRST_CHAR_MULTIPLIER;
+                    take = diag + _FUZZY_SCORE_MATCH + b;
+                }
+            }
+
+            if (take != none && take >= skip) {
+                h[j] = take;
+                run[j] = take_run;
+                gap[j] = false;
+                if (j == fp->len - 1 && take > best) best = take;
+            } else {
+                h[j] = skip;
+                gap[j] = true;
+            }
+        }
+    }
+
+    *score = best;
+    return true;
+}
+
+/* INDEX AND TOP-K */
+
+// Candidates plus their precomputed character masks
+typedef struct {
+    const String *strings;
+    u64 *masks;
+    int count;
+} FuzzyIndex;
+
+static void _fuzzy_index_masks(void *ctx, usize chunk) {
+    FuzzyIndex *idx = (FuzzyIndex*)ctx;
+    int start = (int)chunk * FUZZY_PARALLEL_MIN;
+    int end = start + FUZZY_PARALLEL_MIN < idx->count ? start + FUZZY_PARALLEL_MIN : idx->count;
+    for (int i = start; i < end; ++i) idx->masks[i] = fuzzy_char_mask(idx->strings[i]);
+}
+
+// The strings must outlive the index
+static bool fuzzy_index_init(Allocator *alloc, FuzzyIndex *idx, const String *strings, int count, int threads) {
+    *idx = (FuzzyIndex){.strings = strings, .count = count};
+    idx->masks = (u64*)alloc->alloc(alloc, (count ? count : 1) * sizeof(u64));
+    if (!idx->masks) {
+        err("Allocation failed\n");
+        return false;
+    }
+    usize chunks = ((usize)count + FUZZY_PARALLEL_MIN - 1) / FUZZY_PARALLEL_MIN;
+    parallel_for(threads, chunks, _fuzzy_index_masks, idx);
+    return true;
+}
+
+static void fuzzy_index_deinit(Allocator *alloc, FuzzyIndex *idx) {
+    if (alloc->free) alloc->free(alloc, idx->masks);
+    *idx = (FuzzyIndex){0};
+}
+
+// Ranking: higher score, then shorter candidate, then earlier index
+static inline bool _fuzzy_better(const FuzzyIndex *idx, FuzzyMatch a, FuzzyMatch b) {
+    if (a.score != b.score) return a.score > b.score;
+    int la = idx->strings[a.index].len, lb = idx->strings[b.index].len;
+    if (la != lb) return la < lb;
+    return a.index < b.index;
+}
+
+// Min-heap on rank, so heap[0] is the worst of the current top K
+static void _fuzzy_heap_push(const FuzzyIndex *idx, FuzzyMatch *heap, int *n, int k, FuzzyMatch m) {
+    int i;
+    if (*n < k) {
+        i = (*n)++;
+        while (i > 0 && _fuzzy_better(idx, heap[(i - 1) / 2], m)) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = m;
+        return;
+    }
+    if (!_fuzzy_better(idx, m, heap[0])) return;
+
+    i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= *n) break;
+        if (c + 1 < *n && _fuzzy_better(idx, heap[c], heap[c + 1])) c++;
+        if (!_fuzzy_better(idx, m, heap[c])) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = m;
+}
+
+static int _fuzzy_scan(const FuzzyIndex *idx, const FuzzyPattern *fp, int start, int end, int k, FuzzyMatch *heap) {
+    int n = 0;
+    for (int i = start; i < end; ++i) {
+        if (fp->mask & ~idx->masks[i]) continue;
+        int score;
+        if (fuzzy_score(fp, idx->strings[i], &score))
+            _fuzzy_heap_push(idx, heap, &n, k, (FuzzyMatch){i, score});
+    }
+    return n;
+}
+
+typedef struct {
+    const FuzzyIndex *index;
+    const FuzzyPattern *pattern;
+    int k;
+    FuzzyMatch *heaps;  // k per chunk
+    int *counts;
+} _FuzzyTopK;
+
+static void _fuzzy_top_k_chunk(void *ctx, usize chunk) {
+    _FuzzyTopK *t = (_FuzzyTopK*)ctx;
+    int start = (int)chunk * FUZZY_PARALLEL_MIN;
+    int end = start + FUZZY_PARALLEL_MIN < t->index->count ? start + FUZZY_PARALLEL_MIN : t->index->count;
+    t->counts[chunk] = _fuzzy_scan(t->index, t->pattern, start, end, t->k, t->heaps + chunk * t->k);
+}
+
+// Writes the k best matches for pattern to out, best first, and returns how
+// many there were. Large indexes are scored on up to threads threads (0 for
+// one per CPU), each chunk keeping its own top K before they are merged.
+static int fuzzy_top_k(Allocator *alloc, const FuzzyIndex *idx, String pattern, int k, FuzzyMatch *out, int threads) {
+    if (k <= 0) return 0;
+    FuzzyPattern fp = fuzzy_pattern(pattern);
+    int n = 0;
+
+    if (idx->count < FUZZY_PARALLEL_MIN * 2 || threads == 1) {
+        n = _fuzzy_scan(idx, &fp, 0, idx->count, k, out);
+    } else {
+        usize chunks = ((usize)idx->count + FUZZY_PARALLEL_MIN - 1) / FUZZY_PARALLEL_MIN;
+        _FuzzyTopK t = {.index = idx, .pattern = &fp, .k = k};
+        t.heaps = (FuzzyMatch*)alloc->alloc(alloc, chunks * k * sizeof(FuzzyMatch));
+        t.counts = (int*)alloc->alloc(alloc, chunks * sizeof(int));
+        if (!t.heaps || !t.counts) {
+            err("Allocation failed\n");
+            return 0;
+        }
+        parallel_for(threads, chunks, _fuzzy_top_k_chunk, &t);
+        for (usize c = 0; c < chunks; ++c) {
+            for (int i = 0; i < t.counts[c]; ++i) _fuzzy_heap_push(idx, out, &n, k, t.heaps[c * k + i]);
+        }
+        if (alloc->free) {
+            alloc->free(alloc, t.heaps);
+            alloc->free(alloc, t.counts);
+        }
+    }
+
+    // Heap to best-first order: repeatedly move the worst to the back
+    for (int end = n - 1; end > 0; --end) {
+        FuzzyMatch worst = out[0];
+        FuzzyMatch last = out[end];
+        int size = end;
+        int i = 0;
+        for (;;) {
+            int c = 2 * i + 1;
+            if (c >= size) break;
+            if (c + 1 < size && _fuzzy_better(idx, out[c], out[c + 1])) c++;
+            if (!_fuzzy_better(idx, last, out[c])) break;
+            out[i] = out[c];
+            i = c;
+        }
+        out[i] = last;
+        out[end] = worst;
+    }
+    return n;
+}
+
+#endif
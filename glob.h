@@ -0,0 +1,347 @@
+#ifndef GLOB_H
+#define GLOB_H
+
+// Compiled glob patterns over '/'-separated paths.
+//
+//   *       any run of characters within one component
+//   ?       any single character
+//   [a-z]   a character class, negated with [!...] or [^...]
+//   **      a whole component matching zero or more components
+//   {a,b}   alternatives, expanded when the pattern is compiled
+//   \x      the character x literally
+//
+// A pattern without a separator only matches single-component paths, so
+// write "**/*.wav" to find files at any depth. Components are matched as a
+// set of states advancing in lockstep rather than by backtracking across
+// separators, so matching stays linear in the number of components.
+
+#include "allocator.h"
+#include "log.h"
+#include "strings.h"
+#include "types.h"
+#include "walk.h"
+
+#define GLOB_MAX_ALTERNATIVES 256
+#define GLOB_MAX_SEGMENTS 63
+
+typedef u32 GlobFlags;
+enum GlobFlag {
+    Glob_NoCase = 1 << 0,
+};
+
+typedef u8 GlobSegmentKind;
+enum GlobSegmentKinds {
+    GlobSeg_Literal,    // compared byte for byte
+    GlobSeg_Any,        // "*"
+    GlobSeg_Suffix,     // "*" followed by a literal, e.g. "*.wav"
+    GlobSeg_Wild,       // anything else with wildcards
+    GlobSeg_Globstar,   // "**"
+};
+
+typedef struct {
+    GlobSegmentKind kind;
+    int start;          // into the pattern text, past the '*' for suffixes
+    int len;
+} GlobSegment;
+
+typedef struct {
+    char *text;         // brace-expanded pattern
+    GlobSegment *segments;
+    int count;
+} GlobPattern;
+
+typedef struct {
+    GlobPattern *patterns;
+    int count;
+    GlobFlags flags;
+} Glob;
+
+static char _glob_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+static bool _glob_char_eq(char a, char b, bool nocase) {
+    return a == b || (nocase && _glob_lower(a) == _glob_lower(b));
+}
+
+// Index of the ']' closing the class opening at p[i], or -1
+static int _glob_class_end(const char *p, int m, int i) {
+    int j = i + 1;
+    if (j < m && (p[j] == '!' || p[j] == '^')) j++;
+    if (j < m && p[j] == ']') j++;
+    while (j < m && p[j] != ']') j++;
+    return j < m ? j : -1;
+}
+
+static bool _glob_class_has(const char *p, int start, int end, char c) {
+    for (int i = start; i < end; ++i) {
+        if (i + 2 < end && p[i + 1] == '-') {
+            if ((u8)c >= (u8)p[i] && (u8)c <= (u8)p[i + 2]) return true;
+            i += 2;
+        } else if (p[i] == c) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Matches one pattern element at p[*i] against c and moves *i past it
+static bool _glob_match_one(const char *p, int m, int *i, char c, bool nocase) {
+    char pc = p[*i];
+    if (pc == '?') {
+        *i += 1;
+        return true;
+    }
+    if (pc == '\\' && *i + 1 < m) {
+        *i += 2;
+        return _glob_char_eq(p[*i - 1], c, nocase);
+    }
+    if (pc == '[') {
+        int end = _glob_class_end(p, m, *i);
+        if (end >= 0) {
+            int start = *i + 1;
+            bool negate = p[start] == '!' || p[start] == '^';
+            start += negate;
+            bool in = _glob_class_has(p, start, end, c);
+            if (!in && nocase) {
+                char other = c >= 'a' && c <= 'z' ? c - 32 : _glob_lower(c);
+                in = other != c && _glob_class_has(p, start, end, other);
+            }
+            *i = end + 1;
+            return in != negate;
+        }
+    }
+    *i += 1;
+    return _glob_char_eq(pc, c, nocase);
+}
+
+// Wildcard match within one component. Only the latest '*' is ever
+// retried, which bounds the work to O(len(p) * len(s)).
+static bool _glob_match_wild(const char *p, int m, const char *s, int n, bool nocase) {
+    int pi = 0, si = 0, star = -1, star_si = 0;
+    while (si < n) {
+        if (pi < m && p[pi] == '*') {
+            star = ++pi;
+            star_si = si;
+            continue;
+        }
+        int next = pi;
+        if (pi < m && _glob_match_one(p, m, &next, s[si], nocase)) {
+            pi = next;
+            si++;
+            continue;
+        }
+        if (star < 0) return false;
+        pi = star;
+        si = ++star_si;
+    }
+    while (pi < m && p[pi] == '*') pi++;
+    return pi == m;
+}
+
+static bool _glob_bytes_eq(const char *a, const char *b, int len, bool nocase) {
+    if (!nocase) return memcmp(a, b, len) == 0;
+    for (int i = 0; i < len; ++i) {
+        if (_glob_lower(a[i]) != _glob_lower(b[i])) return false;
+    }
+    return true;
+}
+
+static bool _glob_segment_match(const GlobPattern *gp, const GlobSegment *seg, String name, bool nocase) {
+    const char *p = gp->text + seg->start;
+    switch (seg->kind) {
+    case GlobSeg_Literal:
+        return name.len == seg->len && _glob_bytes_eq(p, name.data, seg->len, nocase);
+    case GlobSeg_Any:
+    case GlobSeg_Globstar:
+        return true;
+    case GlobSeg_Suffix:
+        return name.len >= seg->len && _glob_bytes_eq(p, name.data + name.len - seg->len, seg->len, nocase);
+    default:
+        return _glob_match_wild(p, seg->len, name.data, name.len, nocase);
+    }
+}
+
+static GlobSegmentKind _glob_segment_kind(const char *p, int len) {
+    if (len == 2 && p[0] == '*' && p[1] == '*') return GlobSeg_Globstar;
+    int metas = 0;
+    for (int i = 0; i < len; ++i) {
+        if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '\\') metas++;
+    }
+    if (metas == 0) return GlobSeg_Literal;
+    if (metas == 1 && p[0] == '*') return len == 1 ? GlobSeg_Any : GlobSeg_Suffix;
+    return GlobSeg_Wild;
+}
+
+static bool _glob_add_pattern(Allocator *a, Glob *g, const char *text, int len) {
+    if (g->count == GLOB_MAX_ALTERNATIVES) {
+        err("Glob expands to more than %d patterns\n", GLOB_MAX_ALTERNATIVES);
+        return false;
+    }
+    GlobPattern *gp = &g->patterns[g->count];
+    *gp = (GlobPattern){0};
+    gp->text = (char*)a->alloc(a, len + 1);
+    gp->segments = (GlobSegment*)a->alloc(a, (len / 2 + 1) * sizeof(GlobSegment));
+    if (!gp->text || !gp->segments) return false;
+    memcpy(gp->text, text, len);
+    gp->text[len] = 0;
+    g->count++;
+
+    for (int i = 0; i < len;) {
+        while (i < len && path_is_sep(text[i])) i++;
+        int start = i;
+        while (i < len && !path_is_sep(text[i])) i++;
+        if (i == start) break;
+        // Repeated globstars match the same paths as one
+        GlobSegmentKind kind = _glob_segment_kind(text + start, i - start);
+        if (kind == GlobSeg_Globstar && gp->count && gp->segments[gp->count - 1].kind == GlobSeg_Globstar) continue;
+        if (gp->count == GLOB_MAX_SEGMENTS) {
+            err("Glob has more than %d components\n", GLOB_MAX_SEGMENTS);
+            return false;
+        }
+        GlobSegment *seg = &gp->segments[gp->count++];
+        seg->kind = kind;
+        seg->start = start + (kind == GlobSeg_Suffix);
+        seg->len = i - seg->start;
+    }
+    return true;
+}
+
+// Expands the first top-level brace group and recurses on each alternative
+static bool _glob_expand(Allocator *a, Glob *g, const char *p, int len) {
+    int open = -1, depth = 0;
+    int commas[GLOB_MAX_ALTERNATIVES + 1];
+    int comma_count = 0;
+    for (int i = 0; i < len; ++i) {
+        if (p[i] == '\\') {
+            i++;
+        } else if (p[i] == '[') {
+            int end = _glob_class_end(p, len, i);
+            if (end >= 0) i = end;
+        } else if (p[i] == '{') {
+            if (depth++ == 0) {
+                open = i;
+                comma_count = 0;
+            }
+        } else if (p[i] == '}' && depth > 0) {
+            if (--depth > 0) continue;
+            if (comma_count == 0) {
+                open = -1;
+                continue;
+            }
+            commas[comma_count++] = i;
+
+            char *buf = (char*)a->alloc(a, len);
+            if (!buf) return false;
+            bool ok = true;
+            int prev = open;
+            for (int c = 0; c < comma_count && ok; ++c) {
+                int opt = prev + 1, opt_len = commas[c] - opt;
+                int n = 0;
+                memcpy(buf + n, p, open);
+                n += open;
+                memcpy(buf + n, p + opt, opt_len);
+                n += opt_len;
+                memcpy(buf + n, p + i + 1, len - i - 1);
+                n += len - i - 1;
+                ok = _glob_expand(a, g, buf, n);
+                prev = commas[c];
+            }
+            a->free(a, buf);
+            return ok;
+        } else if (p[i] == ',' && depth == 1) {
+            if (comma_count == GLOB_MAX_ALTERNATIVES) {
+                err("Glob brace has more than %d alternatives\n", GLOB_MAX_ALTERNATIVES);
+                return false;
+            }
+            commas[comma_count++] = i;
+        }
+    }
+    // No complete brace group left, so braces are literal
+    return _glob_add_pattern(a, g, p, len);
+}
+
+static void glob_deinit(Allocator *a, Glob *g) {
+    for (int i = 0; i < g->count; ++i) {
+        a->free(a, g->patterns[i].text);
+        a->free(a, g->patterns[i].segments);
+    }
+    a->free(a, g->patterns);
+    *g = (Glob){0};
+}
+
+static bool glob_compile(Allocator *a, Glob *g, String pattern, GlobFlags flags) {
+    *g = (Glob){.flags = flags};
+    g->patterns = (GlobPattern*)a->alloc(a, GLOB_MAX_ALTERNATIVES * sizeof(GlobPattern));
+    if (!g->patterns) return false;
+    if (!_glob_expand(a, g, pattern.data, pattern.len)) {
+        glob_deinit(a, g);
+        return false;
+    }
+    return true;
+}
+
+// Globstars also stand for zero components, so they pass their state on
+static u64 _glob_closure(const GlobPattern *gp, u64 states) {
+    for (int i = 0; i < gp->count; ++i) {
+        if ((states >> i & 1) && gp->segments[i].kind == GlobSeg_Globstar) states |= 1ull << (i + 1);
+    }
+    return states;
+}
+
+// States of gp after consuming every component of path. Bit i means the
+// components so far matched the first i segments.
+static u64 _glob_run(const GlobPattern *gp, String path, bool nocase) {
+    u64 states = _glob_closure(gp, 1);
+    for (int i = 0; i < path.len && states;) {
+        while (i < path.len && path_is_sep(path.data[i])) i++;
+        int start = i;
+        while (i < path.len && !path_is_sep(path.data[i])) i++;
+        if (i == start) break;
+        String name = {path.data + start, i - start};
+
+        u64 next = 0;
+        for (u64 s = states & ((1ull << gp->count) - 1); s; s &= s - 1) {
+            int k = __builtin_ctzll(s);
+            const GlobSegment *seg = &gp->segments[k];
+            if (seg->kind == GlobSeg_Globstar) next |= 1ull << k;
+            else if (_glob_segment_match(gp, seg, name, nocase)) next |= 1ull << (k + 1);
+        }
+        states = _glob_closure(gp, next);
+    }
+    return states;
+}
+
+static bool glob_match(const Glob *g, String path) {
+    bool nocase = g->flags & Glob_NoCase;
+    for (int i = 0; i < g->count; ++i) {
+        const GlobPattern *gp = &g->patterns[i];
+        if (_glob_run(gp, path, nocase) >> gp->count & 1) return true;
+    }
+    return false;
+}
+
+// Whether anything below the directory dir could match, i.e. whether a walk
+// needs to descend into it
+static bool glob_match_dir(const Glob *g, String dir) {
+    bool nocase = g->flags & Glob_NoCase;
+    for (int i = 0; i < g->count; ++i) {
+        const GlobPattern *gp = &g->patterns[i];
+        if (_glob_run(gp, dir, nocase) & ((1ull << gp->count) - 1)) return true;
+    }
+    return false;
+}
+
+// WalkOptions callbacks, with the Glob as filter_user. Paths are matched
+// relative to the walk's root:
+//
+//   WalkOptions opts = {.descend = glob_walk_descend, .filter = glob_walk_filter, .filter_user = &glob};
+static bool glob_walk_descend(void *glob, const WalkEntry *entry) {
+    return glob_match_dir((const Glob*)glob, entry->relative);
+}
+
+static bool glob_walk_filter(void *glob, const WalkEntry *entry) {
+    return glob_match((const Glob*)glob, entry->relative);
+}
+
+#endif
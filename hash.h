@@ -0,0 +1,437 @@
+#ifndef HASH_H
+#define HASH_H
+
+// Fast non-cryptographic hashing and parallel content fingerprints of files.
+//
+// hash64 and hash128 follow wyhash: 48-byte stripes across three independent
+// multiply-mix lanes, so long inputs run near memory bandwidth. hash128 folds
+// the lanes together in two different ways, so both halves depend on every
+// byte.
+//
+// Files are tree hashed. Each FILE_HASH_CHUNK piece is a leaf hashed on its
+// own, and a file with several leaves hashes its list of leaf hashes. This
+// lets one big file keep every core busy. A file of one chunk or less hashes
+// to hash128(contents, size, 0).
+
+#include "allocator.h"
+#include "fs.h"
+#include "log.h"
+#include "thread.h"
+#include "types.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_HASH_CHUNK MB(1)
+// Files up to this size are hashed as they're opened, larger ones are read a
+// chunk at a time across the threads
+#define FILE_HASH_SMALL KB(64)
+
+typedef struct {
+    u64 lo;
+    u64 hi;
+} Hash128;
+
+static const u64 _hash_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+};
+
+static inline void _hash_mum(u64 *a, u64 *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (u64)r;
+    *b = (u64)(r >> 64);
+}
+
+static inline u64 _hash_mix(u64 a, u64 b) {
+    _hash_mum(&a, &b);
+    return a ^ b;
+}
+
+// Reads are little-endian on every target cbase builds for
+static inline u64 _hash_r8(const u8 *p) {
+    u64 v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline u64 _hash_r4(const u8 *p) {
+    u32 v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline u64 _hash_r3(const u8 *p, usize len) {
+    return ((u64)p[0] << 16) | ((u64)p[len >> 1] << 8) | p[len - 1];
+}
+
+static Hash128 hash128(const void *data, usize len, u64 seed) {
+    const u8 *p = (const u8*)data;
+    const u64 *s = _hash_secret;
+    seed ^= _hash_mix(seed ^ s[0], s[1]);
+    u64 alt = seed;
+    u64 a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            usize mid = (len >> 3) << 2;
+            a = (_hash_r4(p) << 32) | _hash_r4(p + mid);
+            b = (_hash_r4(p + len - 4) << 32) | _hash_r4(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = _hash_r3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        usize i = len;
+        if (i > 48) {
+            u64 see1 = seed, see2 = seed;
+            do {
+                seed = _hash_mix(_hash_r8(p) ^ s[1], _hash_r8(p + 8) ^ seed);
+                see1 = _hash_mix(_hash_r8(p + 16) ^ s[2], _hash_r8(p + 24) ^ see1);
+                see2 = _hash_mix(_hash_r8(p + 32) ^ s[3], _hash_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            alt = _hash_mix(seed ^ see2, see1 ^ s[2]);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = _hash_mix(_hash_r8(p) ^ s[1], _hash_r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _hash_r8(p + i - 16);
+        b = _hash_r8(p + i - 8);
+    }
+    a ^= s[1];
+    b ^= seed;
+    _hash_mum(&a, &b);
+    return (Hash128){
+        .lo = _hash_mix(a ^ s[0] ^ len, b ^ s[1]),
+        .hi = _hash_mix(a ^ s[2] ^ alt, b ^ s[3] ^ len),
+    };
+}
+
+static u64 hash64(const void *data, usize len, u64 seed) {
+    return hash128(data, len, seed).lo;
+}
+
+static bool hash128_eq(Hash128 a, Hash128 b) {
+    return a.lo == b.lo && a.hi == b.hi;
+}
+
+
+/* FINGERPRINT CACHE */
+
+// What a file hashed to when it had this inode, mtime and size
+typedef struct {
+    u64 dev;
+    u64 ino;        // 0 for an empty slot
+    i64 mtime;      // nanoseconds
+    u64 size;
+    Hash128 hash;
+} FileHashRecord;
+
+// Open-addressed table of records by (dev, ino), saved to disk as a header
+// and the records in host byte order. Start one with file_hash_cache_init or
+// file_hash_cache_load; a zeroed cache has no allocator to grow with.
+typedef struct {
+    Allocator *alloc;
+    FileHashRecord *records;
+    usize count;
+    usize cap;
+} FileHashCache;
+
+#define _FILE_HASH_MAGIC 0x48464243u // "CBFH"
+#define _FILE_HASH_VERSION 1u
+
+static usize _file_hash_slot(const FileHashCache *c, u64 dev, u64 ino) {
+    usize mask = c->cap - 1;
+    usize i = (usize)_hash_mix(dev ^ _hash_secret[0], ino ^ _hash_secret[1]) & mask;
+    while (c->records[i].ino && (c->records[i].ino != ino || c->records[i].dev != dev)) i = (i + 1) & mask;
+    return i;
+}
+
+static bool _file_hash_cache_grow(FileHashCache *c, usize need) {
+    if (need * 4 <= c->cap * 3) return true;
+    if (!c->alloc) {
+        err("Hash cache used without file_hash_cache_init\n");
+        return false;
+    }
+    usize cap = c->cap ? c->cap : 1024;
+    while (need * 4 > cap * 3) cap *= 2;
+    FileHashRecord *old = c->records;
+    usize old_cap = c->cap;
+    c->records = (FileHashRecord*)c->alloc->alloc(c->alloc, cap * sizeof(FileHashRecord));
+    if (!c->records) {
+        c->records = old;
+        return false;
+    }
+    memset(c->records, 0, cap * sizeof(FileHashRecord));
+    c->cap = cap;
+    for (usize i = 0; i < old_cap; ++i) {
+        if (old[i].ino) c->records[_file_hash_slot(c, old[i].dev, old[i].ino)] = old[i];
+    }
+    if (old) c->alloc->free(c->alloc, old);
+    return true;
+}
+
+// An empty cache. The table is allocated on the first put.
+static FileHashCache file_hash_cache_init(Allocator *alloc) {
+    return (FileHashCache){.alloc = alloc};
+}
+
+static void file_hash_cache_put(FileHashCache *c, const FileHashRecord *record) {
+    if (!record->ino || !_file_hash_cache_grow(c, c->count + 1)) return;
+    FileHashRecord *slot = &c->records[_file_hash_slot(c, record->dev, record->ino)];
+    if (!slot->ino) c->count++;
+    *slot = *record;
+}
+
+// Cached hash of the file st describes, if it's unchanged since it was hashed
+static bool file_hash_cache_get(const FileHashCache *c, const struct stat *st, Hash128 *out) {
+    if (!c->cap) return false;
+    const FileHashRecord *r = &c->records[_file_hash_slot(c, (u64)st->st_dev, (u64)st->st_ino)];
+    i64 mtime = (i64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    if (!r->ino || r->mtime != mtime || r->size != (u64)st->st_size) return false;
+    *out = r->hash;
+    return true;
+}
+
+static void file_hash_cache_deinit(FileHashCache *c) {
+    if (c->records) c->alloc->free(c->alloc, c->records);
+    *c = (FileHashCache){0};
+}
+
+// Loads the cache saved at path. A missing or unreadable cache file just
+// starts an empty cache.
+static bool file_hash_cache_load(FileHashCache *c, Allocator *alloc, const char *path) {
+    *c = file_hash_cache_init(alloc);
+    if (!_file_hash_cache_grow(c, 1)) return false;
+    FileHandle f = file_handle_open(path, FileOpen_ReadOnly);
+    if (f.fd < 0) return true;
+
+    u32 header[4];
+    bool ok = f.size >= sizeof(header) && file_pread(f, header, sizeof(header), 0) == sizeof(header) &&
+              header[0] == _FILE_HASH_MAGIC && header[1] == _FILE_HASH_VERSION;
+    u64 count = ok ? (u64)header[2] | (u64)header[3] << 32 : 0;
+    if (ok && count != (f.size - sizeof(header)) / sizeof(FileHashRecord)) {
+        err("Ignoring truncated hash cache %s\n", path);
+        count = 0;
+    }
+    if (count && _file_hash_cache_grow(c, count)) {
+        FileHashRecord batch[256];
+        for (u64 i = 0; i < count; i += 256) {
+            usize n = count - i < 256 ? (usize)(count - i) : 256;
+            u64 offset = sizeof(header) + i * sizeof(FileHashRecord);
+            if (file_pread(f, batch, n * sizeof(FileHashRecord), offset) != (isize)(n * sizeof(FileHashRecord))) break;
+            for (usize j = 0; j < n; ++j) file_hash_cache_put(c, &batch[j]);
+        }
+    }
+    file_handle_close(&f);
+    return true;
+}
+
+// Writes the cache to a temporary file, synced and then renamed over path, so
+// a crash never leaves a torn cache behind
+static bool file_hash_cache_save(const FileHashCache *c, const char *path) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return false;
+    FileHandle f = file_handle_open(tmp, 0);
+    if (f.fd < 0) {
+        err("Failed to open %s: %s\n", tmp, strerror(errno));
+        return false;
+    }
+    u32 header[4] = {_FILE_HASH_MAGIC, _FILE_HASH_VERSION, (u32)c->count, (u32)((u64)c->count >> 32)};
+    bool ok = file_pwrite(f, header, sizeof(header), 0);
+    u64 offset = sizeof(header);
+    FileHashRecord batch[256];
+    usize n = 0;
+    for (usize i = 0; i <= c->cap && ok; ++i) {
+        if (i < c->cap && !c->records[i].ino) continue;
+        if (i < c->cap) batch[n++] = c->records[i];
+        if (n == 256 || (i == c->cap && n)) {
+            ok = file_pwrite(f, batch, n * sizeof(FileHashRecord), offset);
+            offset += n * sizeof(FileHashRecord);
+            n = 0;
+        }
+    }
+    // Without the sync the rename can reach the disk before the records do
+    if (ok) ok = fdatasync(f.fd) == 0;
+    file_handle_close(&f);
+    if (!ok || rename(tmp, path) != 0) {
+        err("Failed to save hash cache %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+
+/* FILE HASHING */
+
+typedef struct {
+    Hash128 hash;
+    u64 size;
+    bool ok;
+    bool cached;    // taken from the cache without reading the file
+} FileHash;
+
+typedef struct {
+    struct stat st;
+    usize size;         // bytes to hash in chunks, 0 if hashed already
+    Hash128 *leaves;
+    usize leaf_count;
+    bool changed;       // shrank or was replaced while being read
+} _FileHashFile;
+
+typedef struct {
+    const char **paths;
+    FileHash *out;
+    _FileHashFile *files;
+    const FileHashCache *cache;
+    u32 *chunk_file;    // file of each chunk job
+    usize *chunk_index;
+} _FileHashJob;
+
+// Stats, answers from the cache, hashes small files outright and leaves the
+// rest to the chunk jobs
+static void _file_hash_open(void *ctx, usize i) {
+    _FileHashJob *job = (_FileHashJob*)ctx;
+    _FileHashFile *file = &job->files[i];
+    FileHash *out = &job->out[i];
+    FileHandle f = file_handle_open(job->paths[i], FileOpen_ReadOnly);
+    if (f.fd < 0 || fstat(f.fd, &file->st) != 0 || !S_ISREG(file->st.st_mode)) {
+        file_handle_close(&f);
+        return;
+    }
+    out->size = (u64)file->st.st_size;
+    if (job->cache && file_hash_cache_get(job->cache, &file->st, &out->hash)) {
+        out->ok = out->cached = true;
+    } else if (out->size <= FILE_HASH_SMALL) {
+        u8 buf[FILE_HASH_SMALL];
+        isize n = file_pread(f, buf, (usize)out->size, 0);
+        if (n >= 0) {
+            out->size = (u64)n;
+            out->hash = hash128(buf, (usize)n, 0);
+            out->ok = true;
+        }
+    } else {
+        file->size = (usize)out->size;
+    }
+    file_handle_close(&f);
+}
+
+// Reads with pread rather than through a mapping: the files being fingerprinted
+// are often still being written, and touching a mapped page past the end of a
+// truncated file raises SIGBUS. The path is reopened so that no descriptors
+// are held between chunks, and a file replaced in the meantime is noticed.
+static void _file_hash_chunk(void *ctx, usize i) {
+    _FileHashJob *job = (_FileHashJob*)ctx;
+    u32 f_index = job->chunk_file[i];
+    _FileHashFile *file = &job->files[f_index];
+    usize index = job->chunk_index[i];
+    usize offset = index * FILE_HASH_CHUNK;
+    usize len = file->size - offset < FILE_HASH_CHUNK ? file->size - offset : FILE_HASH_CHUNK;
+
+    bool ok = false;
+    u8 *buf = (u8*)malloc(len);
+    FileHandle f = file_handle_open(job->paths[f_index], FileOpen_ReadOnly);
+    struct stat st;
+    if (buf && f.fd >= 0 && fstat(f.fd, &st) == 0 && st.st_dev == file->st.st_dev && st.st_ino == file->st.st_ino &&
+        file_pread(f, buf, len, offset) == (isize)len) {
+        file->leaves[index] = hash128(buf, len, index);
+        ok = true;
+    }
+    file_handle_close(&f);
+    free(buf);
+    if (!ok) __atomic_store_n(&file->changed, true, __ATOMIC_RELAXED);
+}
+
+static void _file_hash_finish(void *ctx, usize i) {
+    _FileHashJob *job = (_FileHashJob*)ctx;
+    _FileHashFile *file = &job->files[i];
+    if (!file->leaves || file->changed) return;
+    if (file->leaf_count == 1) job->out[i].hash = file->leaves[0];
+    else job->out[i].hash = hash128(file->leaves, file->leaf_count * sizeof(Hash128), file->size);
+    job->out[i].ok = true;
+}
+
+// Fingerprints count files on up to threads threads (0 for one per CPU).
+// Small files are hashed as they're opened; large ones are split into chunks
+// and every chunk of every file is shared out across the threads. With a
+// cache, files whose inode, mtime and size match a record aren't read at all,
+// and the newly hashed files are recorded. A file that shrinks or is replaced
+// while it's being read comes back not ok.
+static void file_hash_many(Allocator *alloc, const char **paths, usize count, FileHash *out, FileHashCache *cache, int threads) {
+    memset(out, 0, count * sizeof(FileHash));
+    _FileHashFile *files = (_FileHashFile*)alloc->alloc(alloc, count * sizeof(_FileHashFile));
+    if (!files) return;
+    memset(files, 0, count * sizeof(_FileHashFile));
+    _FileHashJob job = {.paths = paths, .out = out, .files = files, .cache = cache};
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+
+    parallel_for(threads, count, _file_hash_open, &job);
+
+    usize chunks = 0;
+    for (usize i = 0; i < count; ++i) {
+        if (!files[i].size) continue;
+        files[i].leaf_count = (files[i].size + FILE_HASH_CHUNK - 1) / FILE_HASH_CHUNK;
+        files[i].leaves = (Hash128*)alloc->alloc(alloc, files[i].leaf_count * sizeof(Hash128));
+        if (files[i].leaves) chunks += files[i].leaf_count;
+    }
+    job.chunk_file = (u32*)alloc->alloc(alloc, (chunks ? chunks : 1) * sizeof(u32));
+    job.chunk_index = (usize*)alloc->alloc(alloc, (chunks ? chunks : 1) * sizeof(usize));
+    if (job.chunk_file && job.chunk_index) {
+        usize n = 0;
+        for (usize i = 0; i < count; ++i) {
+            if (!files[i].leaves) continue;
+            for (usize k = 0; k < files[i].leaf_count; ++k) {
+                job.chunk_file[n] = (u32)i;
+                job.chunk_index[n++] = k;
+            }
+        }
+        parallel_for(threads, chunks, _file_hash_chunk, &job);
+    } else {
+        for (usize i = 0; i < count; ++i) {
+            if (files[i].leaves) alloc->free(alloc, files[i].leaves);
+            files[i].leaves = NULL;
+        }
+    }
+    parallel_for(threads, count, _file_hash_finish, &job);
+
+    // A file written within a second of hashing could change again without
+    // its mtime moving, so only settled files are recorded
+    i64 settled = ((i64)start.tv_sec - 1) * 1000000000 + start.tv_nsec;
+    for (usize i = 0; i < count; ++i) {
+        if (files[i].leaves) alloc->free(alloc, files[i].leaves);
+        if (!cache || !out[i].ok || out[i].cached) continue;
+        const struct stat *st = &files[i].st;
+        FileHashRecord record = {
+            .dev = (u64)st->st_dev,
+            .ino = (u64)st->st_ino,
+            .mtime = (i64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec,
+            .size = out[i].size,
+            .hash = out[i].hash,
+        };
+        if (record.mtime < settled) file_hash_cache_put(cache, &record);
+    }
+    if (job.chunk_file) alloc->free(alloc, job.chunk_file);
+    if (job.chunk_index) alloc->free(alloc, job.chunk_index);
+    alloc->free(alloc, files);
+}
+
+static bool file_hash(const char *path, Hash128 *out) {
+    LibCAllocator heap = heap_allocator_init();
+    FileHash result;
+    file_hash_many(&heap.allocator, &path, 1, &result, NULL, 0);
+    *out = result.hash;
+    return result.ok;
+}
+
+#endif
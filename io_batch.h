@@ -0,0 +1,435 @@
+#ifndef IO_BATCH_H
+#define IO_BATCH_H
+
+// Batched whole-file loads. On Linux the open, read and close of many files are
+// queued on an io_uring so hundreds are in flight at once; liburing isn't
+// needed, the ring is driven with raw syscalls. Where io_uring is missing or
+// blocked the same batch runs on a pool of blocking threads instead.
+
+#include "allocator.h"
+#include "fs.h"
+#include "log.h"
+#include "thread.h"
+#include "types.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Files in flight at once
+#define IO_BATCH_DEPTH 256
+
+typedef struct {
+    const char *path;
+    u8 *data;       // arena-allocated contents
+    usize size;
+    int error;      // errno value, 0 on success
+} IoFileResult;
+
+typedef void (*IoBatchFn)(void *user, const IoFileResult *result);
+
+typedef enum {
+    _IoOpen,
+    _IoRead,
+    _IoClose,
+} _IoStage;
+
+typedef struct {
+    IoFileResult result;
+    IoBatchFn fn;
+    void *user;
+    int fd;
+    usize done;     // bytes read so far
+    bool reported;  // fn has been called
+    bool closing;   // a close of fd is queued on the ring
+} _IoRequest;
+
+#ifdef __linux__
+typedef struct {
+    int fd;
+    u32 *sq_head, *sq_tail, *sq_mask, *sq_array;
+    u32 sq_entries;
+    struct io_uring_sqe *sqes;
+    u32 *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    usize sq_len, cq_len, sqes_len;
+    u32 unsubmitted;
+} _IoUring;
+#endif
+
+typedef struct {
+    Allocator *alloc;
+    Arena *arena;
+    pthread_mutex_t arena_lock; // the thread fallback allocates concurrently
+    Array(_IoRequest) requests;
+    int depth;
+    int threads;
+    bool uring_ok;
+#ifdef __linux__
+    _IoUring ring;
+#endif
+} IoBatch;
+
+#ifdef __linux__
+static void _io_uring_deinit(_IoUring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->fd >= 0) close(ring->fd);
+    *ring = (_IoUring){.fd = -1};
+}
+
+static bool _io_uring_init(_IoUring *ring, u32 entries) {
+    *ring = (_IoUring){.fd = -1};
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) return false;
+
+    // Every opcode the batch uses must be there (all arrived in 5.6)
+    usize probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, probe_size);
+    bool ops_ok = probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    u8 ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+    for (usize i = 0; ops_ok && i < sizeof(ops); ++i) {
+        ops_ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if (!ops_ok) {
+        _io_uring_deinit(ring);
+        return false;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(u32);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        if (ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    void *sq = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        _io_uring_deinit(ring);
+        return false;
+    }
+    ring->sq_ptr = sq;
+    void *cq = sq;
+    if (!single) {
+        cq = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            _io_uring_deinit(ring);
+            return false;
+        }
+    }
+    ring->cq_ptr = cq;
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        _io_uring_deinit(ring);
+        return false;
+    }
+    ring->sqes = (struct io_uring_sqe*)sqes;
+
+    u8 *s = (u8*)sq;
+    ring->sq_head = (u32*)(s + p.sq_off.head);
+    ring->sq_tail = (u32*)(s + p.sq_off.tail);
+    ring->sq_mask = (u32*)(s + p.sq_off.ring_mask);
+    ring->sq_array = (u32*)(s + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    u8 *c = (u8*)cq;
+    ring->cq_head = (u32*)(c + p.cq_off.head);
+    ring->cq_tail = (u32*)(c + p.cq_off.tail);
+    ring->cq_mask = (u32*)(c + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(c + p.cq_off.cqes);
+    return true;
+}
+
+// Next free submission entry, zeroed. The batch never has more operations in
+// flight than the ring has entries, so this can't run out.
+static struct io_uring_sqe *_io_uring_sqe(_IoUring *ring, _IoStage stage, u32 index) {
+    u32 tail = *ring->sq_tail;
+    u32 slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((u64)index << 2) | stage;
+    ring->sq_array[slot] = slot;
+    // The kernel may read the entry as soon as it sees the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+    return sqe;
+}
+
+static bool _io_uring_enter(_IoUring *ring, u32 wait) {
+    for (;;) {
+        int r = (int)syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r >= 0) {
+            ring->unsubmitted -= (u32)r;
+            return true;
+        }
+        if (errno != EINTR) return false;
+    }
+}
+
+static void _io_submit_open(IoBatch *b, u32 index) {
+    _IoRequest *req = &b->requests.items[index];
+    struct io_uring_sqe *sqe = _io_uring_sqe(&b->ring, _IoOpen, index);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (u64)(usize)req->result.path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+static void _io_submit_read(IoBatch *b, u32 index) {
+    _IoRequest *req = &b->requests.items[index];
+    struct io_uring_sqe *sqe = _io_uring_sqe(&b->ring, _IoRead, index);
+    usize left = req->result.size - req->done;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = req->fd;
+    sqe->addr = (u64)(usize)(req->result.data + req->done);
+    sqe->len = left < (1u << 30) ? (u32)left : (1u << 30);
+    sqe->off = req->done;
+}
+
+static void _io_submit_close(IoBatch *b, u32 index) {
+    struct io_uring_sqe *sqe = _io_uring_sqe(&b->ring, _IoClose, index);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = b->requests.items[index].fd;
+    b->requests.items[index].closing = true;
+}
+
+// Reports the request and queues the close of its descriptor, if any.
+// Returns true if a close was queued.
+static bool _io_finish(IoBatch *b, u32 index, int error) {
+    _IoRequest *req = &b->requests.items[index];
+    req->result.error = error;
+    if (error) {
+        req->result.data = NULL;
+        req->result.size = 0;
+    }
+    req->fn(req->user, &req->result);
+    req->reported = true;
+    if (req->fd < 0) return false;
+    _io_submit_close(b, index);
+    return true;
+}
+
+static bool _io_batch_run_uring(IoBatch *b) {
+    _IoUring *ring = &b->ring;
+    u32 next = 0, count = (u32)b->requests.len;
+    u32 in_flight = 0;
+    u32 limit = (u32)b->depth < ring->sq_entries ? (u32)b->depth : ring->sq_entries;
+
+    while (next < count || in_flight) {
+        while (next < count && in_flight < limit) {
+            _io_submit_open(b, next++);
+            in_flight++;
+        }
+        if (!_io_uring_enter(ring, 1)) return false;
+
+        u32 head = *ring->cq_head;
+        u32 tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            u32 index = (u32)(cqe->user_data >> 2);
+            _IoStage stage = (_IoStage)(cqe->user_data & 3);
+            int res = cqe->res;
+            _IoRequest *req = &b->requests.items[index];
+
+            bool more = false;
+            if (stage == _IoOpen) {
+                struct stat st;
+                if (res >= 0) req->fd = res;
+                if (res < 0) {
+                    more = _io_finish(b, index, -res);
+                } else if (fstat(req->fd, &st) != 0) {
+                    more = _io_finish(b, index, errno);
+                } else {
+                    req->result.size = (usize)st.st_size;
+                    req->result.data = (u8*)arena_alloc(b->arena, req->result.size + 1);
+                    if (!req->result.data) {
+                        more = _io_finish(b, index, ENOMEM);
+                    } else if (req->result.size == 0) {
+                        more = _io_finish(b, index, 0);
+                    } else {
+                        _io_submit_read(b, index);
+                        more = true;
+                    }
+                }
+            } else if (stage == _IoRead) {
+                if (res < 0) {
+                    more = _io_finish(b, index, -res);
+                } else {
+                    req->done += (usize)res;
+                    // A file that shrank since fstat ends early
+                    if (res == 0) req->result.size = req->done;
+                    if (req->done < req->result.size) {
+                        _io_submit_read(b, index);
+                        more = true;
+                    } else {
+                        req->result.data[req->result.size] = 0;
+                        more = _io_finish(b, index, 0);
+                    }
+                }
+            } else {
+                req->fd = -1;
+            }
+            if (!more) in_flight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// Called after a failed enter, when the ring can't be waited on any more.
+// Closes every descriptor the kernel won't, then tears the ring down.
+static void _io_batch_abandon_uring(IoBatch *b) {
+    _IoUring *ring = &b->ring;
+    // Completions that already arrived: opens handed over descriptors and
+    // closes released them
+    u32 head = *ring->cq_head;
+    u32 tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        _IoRequest *req = &b->requests.items[cqe->user_data >> 2];
+        _IoStage stage = (_IoStage)(cqe->user_data & 3);
+        if (stage == _IoOpen && cqe->res >= 0) req->fd = cqe->res;
+        else if (stage == _IoClose) req->fd = -1;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    // Closes the kernel never consumed fall to us; the submitted ones are its
+    u32 sq_head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for (u32 i = sq_head; i != *ring->sq_tail; ++i) {
+        struct io_uring_sqe *sqe = &ring->sqes[ring->sq_array[i & *ring->sq_mask]];
+        if (sqe->opcode != IORING_OP_CLOSE) continue;
+        close(sqe->fd);
+        b->requests.items[sqe->user_data >> 2].fd = -1;
+    }
+    for each(_IoRequest, req, &b->requests) {
+        if (req->fd >= 0 && !req->closing) close(req->fd);
+        req->fd = -1;
+    }
+
+    _io_uring_deinit(ring);
+    b->uring_ok = false;
+}
+#endif
+
+/* THREAD FALLBACK */
+
+static void _io_batch_load(void *ctx, usize index) {
+    IoBatch *b = (IoBatch*)ctx;
+    _IoRequest *req = &b->requests.items[index];
+    FileHandle f = file_handle_open(req->result.path, FileOpen_ReadOnly);
+    if (f.fd < 0) {
+        req->result.error = errno;
+        return;
+    }
+
+    pthread_mutex_lock(&b->arena_lock);
+    req->result.data = (u8*)arena_alloc(b->arena, f.size + 1);
+    pthread_mutex_unlock(&b->arena_lock);
+    if (!req->result.data) {
+        req->result.error = ENOMEM;
+    } else {
+        isize got = file_pread(f, req->result.data, f.size, 0);
+        if (got < 0) {
+            req->result.error = errno;
+            req->result.data = NULL;
+        } else {
+            req->result.size = (usize)got;
+            req->result.data[got] = 0;
+        }
+    }
+    file_handle_close(&f);
+}
+
+/* BATCH API */
+
+// depth is the number of files in flight with io_uring (IO_BATCH_DEPTH if 0),
+// threads the size of the fallback pool (0 for one per CPU). File contents are
+// allocated from arena.
+static bool io_batch_init(IoBatch *b, Allocator *alloc, Arena *arena, int depth, int threads) {
+    memset(b, 0, sizeof(*b));
+    b->alloc = alloc;
+    b->arena = arena;
+    b->depth = depth > 0 ? depth : IO_BATCH_DEPTH;
+    b->threads = threads;
+    pthread_mutex_init(&b->arena_lock, NULL);
+    array_init_capacity(alloc, &b->requests, 64);
+    if (!b->requests.items) {
+        err("Allocation failed\n");
+        return false;
+    }
+#ifdef __linux__
+    // One operation per file is in flight at a time, plus room for closes
+    b->uring_ok = _io_uring_init(&b->ring, (u32)next_power_of_two((usize)b->depth * 2));
+#endif
+    return true;
+}
+
+// Queues a whole-file read; fn gets the result once io_batch_run processes it.
+// The path is copied.
+static void io_batch_read_file(IoBatch *b, const char *path, IoBatchFn fn, void *user) {
+    int len = string_len(path);
+    char *copy = (char*)arena_alloc(b->arena, len + 1);
+    if (copy) memcpy(copy, path, len + 1);
+    _IoRequest req = {.fn = fn, .user = user, .fd = -1};
+    req.result.path = copy ? copy : path;
+    array_append(b->alloc, &b->requests, req);
+}
+
+// Runs every queued request and returns once all callbacks have been called.
+// Callbacks always run on the calling thread: as each file completes with
+// io_uring, after the whole batch with the thread fallback. The contents are
+// null-terminated.
+static void io_batch_run(IoBatch *b) {
+#ifdef __linux__
+    if (b->uring_ok) {
+        if (_io_batch_run_uring(b)) {
+            b->requests.len = 0;
+            return;
+        }
+        // The ring is gone for good: the requests it didn't report are loaded
+        // again by the threads, and so is every later batch
+        err("io_uring failed: %s\n", strerror(errno));
+        _io_batch_abandon_uring(b);
+        usize kept = 0;
+        for each(_IoRequest, req, &b->requests) {
+            if (req->reported) continue;
+            _IoRequest retry = {.fn = req->fn, .user = req->user, .fd = -1};
+            retry.result.path = req->result.path;
+            b->requests.items[kept++] = retry;
+        }
+        b->requests.len = kept;
+    }
+#endif
+    parallel_for(b->threads, b->requests.len, _io_batch_load, b);
+    for each(_IoRequest, req, &b->requests) {
+        if (req->result.error) req->result.size = 0;
+        req->fn(req->user, &req->result);
+    }
+    b->requests.len = 0;
+}
+
+static void io_batch_deinit(IoBatch *b) {
+#ifdef __linux__
+    if (b->uring_ok) _io_uring_deinit(&b->ring);
+#endif
+    pthread_mutex_destroy(&b->arena_lock);
+    if (b->alloc->free) b->alloc->free(b->alloc, b->requests.items);
+    b->requests.items = NULL;
+}
+
+#endif
@@ -0,0 +1,785 @@
+#ifndef JSON_H
+#define JSON_H
+
+// JSON parsing on top of String and Arena.
+// json_parse builds a flat DOM in an Arena in two passes: a SIMD pass that
+// finds every structural character, then a pass over those offsets only.
+// JsonReader pulls tokens from a stream with a fixed-size window instead.
+// String values are views into the input unless they contain escapes.
+
+#include "allocator.h"
+#include "fs.h"
+#include "number.h"
+#include "simd.h"
+#include "strings.h"
+
+#ifndef JSON_MAX_DEPTH
+#define JSON_MAX_DEPTH 1024
+#endif
+
+typedef enum {
+    JsonNull,
+    JsonBool,
+    JsonNumber,
+    JsonString,
+    JsonArray,
+    JsonObject,
+} JsonType;
+
+typedef enum {
+    JsonOk,
+    JsonErrorSyntax,
+    JsonErrorString,    // bad escape or unterminated string
+    JsonErrorNumber,
+    JsonErrorDepth,     // nested deeper than JSON_MAX_DEPTH
+    JsonErrorMemory,
+} JsonResult;
+
+// Nodes are stored depth-first in one array. A container is followed by its
+// children; an object's children alternate key (a JsonString) and value.
+// node + node->size is always the next sibling.
+typedef struct {
+    JsonType type;
+    u32 size;       // nodes in this subtree, including this one
+    u32 count;      // array elements or object members
+    bool boolean;
+    f64 number;
+    String text;    // string contents, or the source text of a number
+} JsonNode;
+
+typedef struct {
+    JsonNode *nodes;
+    u32 count;
+    usize error_offset;
+} JsonDoc;
+
+/* STRINGS */
+
+// Finds the closing quote of the string whose contents start at p[0].
+// Returns its offset, or -1 if the string is unterminated, in which case
+// *resume is where a later scan over more data can safely pick up.
+// Raw control characters inside strings are accepted.
+static isize _json_string_end(const u8 *p, usize len, bool *has_escape, usize *resume) {
+    String rest = {(char*)p, (int)len};
+    String stops = {"\"\\", 2};
+    for (;;) {
+        int at = string_find_any(rest, stops);
+        if (at < 0) {
+            *resume = len;
+            return -1;
+        }
+        if (rest.data[at] == '"') return (rest.data + at) - (char*)p;
+        *has_escape = true;
+        if (at + 2 > rest.len) {
+            *resume = (rest.data + at) - (char*)p;
+            return -1;
+        }
+        rest = string_slice(rest, at + 2, rest.len);
+    }
+}
+
+static int _json_hex4(const u8 *p) {
+    int v = 0;
+    for (int i = 0; i < 4; ++i) {
+        u8 c = p[i];
+        int d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') d = (c | 0x20) - 'a' + 10;
+        else return -1;
+        v = v * 16 + d;
+    }
+    return v;
+}
+
+// Decodes the escapes in src into dst, which needs len bytes. Returns the
+// decoded length, or -1 on a malformed escape.
+static int _json_unescape(const u8 *src, usize len, char *dst) {
+    char *out = dst;
+    usize i = 0;
+    while (i < len) {
+        if (src[i] != '\\') {
+            *out++ = (char)src[i++];
+            continue;
+        }
+        if (i + 1 >= len) return -1;
+        u8 c = src[i + 1];
+        i += 2;
+        switch (c) {
+        case '"': *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '/': *out++ = '/'; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u': {
+            if (i + 4 > len) return -1;
+            int cp = _json_hex4(src + i);
+            if (cp < 0) return -1;
+            i += 4;
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                int lo = -1;
+                if (i + 6 <= len && src[i] == '\\' && src[i + 1] == 'u')
+                    lo = _json_hex4(src + i + 2);
+                if (lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    i += 6;
+                } else {
+                    cp = 0xfffd;
+                }
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                cp = 0xfffd;
+            }
+            out += utf8_encode(out, (u32)cp);
+        } break;
+        default:
+            return -1;
+        }
+    }
+    return (int)(out - dst);
+}
+
+static inline bool _json_is_boundary(u8 c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+           c == ',' || c == ':' || c == ']' || c == '}' || c == '[' || c == '{';
+}
+
+// JSON's number grammar is stricter than string_parse_f64: a digit must follow
+// the sign, and no inf/nan
+static bool _json_number_start(const u8 *p, usize len) {
+    usize i = p[0] == '-';
+    return i < len && _is_digit(p[i]);
+}
+
+// Length of the number at p under RFC 8259's grammar,
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?, or 0 if it doesn't match.
+// Rejects what string_parse_f64 would take, like "01", "1." and ".5".
+static usize _json_number_len(const u8 *p, usize len) {
+    usize i = 0;
+    if (i < len && p[i] == '-') i++;
+    if (i >= len || !_is_digit(p[i])) return 0;
+    if (p[i] == '0') i++;
+    else while (i < len && _is_digit(p[i])) i++;
+    if (i < len && p[i] == '.') {
+        usize start = ++i;
+        while (i < len && _is_digit(p[i])) i++;
+        if (i == start) return 0;
+    }
+    if (i < len && (p[i] == 'e' || p[i] == 'E')) {
+        i++;
+        if (i < len && (p[i] == '+' || p[i] == '-')) i++;
+        usize start = i;
+        while (i < len && _is_digit(p[i])) i++;
+        if (i == start) return 0;
+    }
+    return i;
+}
+
+/* STRUCTURAL INDEX */
+
+typedef struct {
+    u64 next_escaped;
+    u64 in_string;  // all ones while inside a string across blocks
+    u64 scalar;     // 1 if the previous block ended inside a scalar
+} _JsonScanner;
+
+// Classifies a 64-byte block into bitmasks, bit i for byte i
+static void _json_block_masks(const u8 *p, u64 *backslash, u64 *quote, u64 *space, u64 *op) {
+    *backslash = *quote = *space = *op = 0;
+#if SIMD_WIDTH
+    SimdVec v_bs = simd_splat('\\');
+    SimdVec v_qt = simd_splat('"');
+    SimdVec v_sp = simd_splat(' ');
+    SimdVec v_tab = simd_splat('\t');
+    SimdVec v_lf = simd_splat('\n');
+    SimdVec v_cr = simd_splat('\r');
+    SimdVec v_case = simd_splat(0x20);
+    SimdVec v_lbrace = simd_splat('{');
+    SimdVec v_rbrace = simd_splat('}');
+    SimdVec v_colon = simd_splat(':');
+    SimdVec v_comma = simd_splat(',');
+    for (int k = 0; k < 64; k += SIMD_WIDTH) {
+        SimdVec v = simd_load(p + k);
+        // '[' and ']' are '{' and '}' with bit 5 cleared
+        SimdVec folded = simd_or(v, v_case);
+        *backslash |= (u64)simd_mask(simd_eq(v, v_bs)) << k;
+        *quote |= (u64)simd_mask(simd_eq(v, v_qt)) << k;
+        *space |= (u64)simd_mask(simd_or(simd_or(simd_eq(v, v_sp), simd_eq(v, v_tab)),
+                                         simd_or(simd_eq(v, v_lf), simd_eq(v, v_cr)))) << k;
+        *op |= (u64)simd_mask(simd_or(simd_or(simd_eq(folded, v_lbrace), simd_eq(folded, v_rbrace)),
+                                      simd_or(simd_eq(v, v_colon), simd_eq(v, v_comma)))) << k;
+    }
+#else
+    for (int k = 0; k < 64; ++k) {
+        u8 c = p[k];
+        u64 bit = (u64)1 << k;
+        if (c == '\\') *backslash |= bit;
+        if (c == '"') *quote |= bit;
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') *space |= bit;
+        if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') *op |= bit;
+    }
+#endif
+}
+
+static inline u64 _json_prefix_xor(u64 x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Writes the offset of every structural character, opening quote and scalar
+// start to out (which needs room for len + 1 entries). Returns the count, or
+// -1 if the input ends inside a string.
+static isize _json_index(const u8 *p, usize len, u32 *out) {
+    const u64 odd_bits = 0xaaaaaaaaaaaaaaaaull;
+    _JsonScanner sc = {0};
+    usize n = 0;
+    u8 pad[64];
+
+    for (usize base = 0; base < len; base += 64) {
+        const u8 *block = p + base;
+        u64 valid = ~(u64)0;
+        if (base + 64 > len) {
+            memset(pad, ' ', sizeof(pad));
+            memcpy(pad, block, len - base);
+            block = pad;
+            valid = ((u64)1 << (len - base)) - 1;
+        }
+
+        u64 backslash, quote, space, op;
+        _json_block_masks(block, &backslash, &quote, &space, &op);
+
+        // A character is escaped when preceded by an odd run of backslashes
+        u64 escaped;
+        if (!backslash) {
+            escaped = sc.next_escaped;
+            sc.next_escaped = 0;
+        } else {
+            u64 potential = backslash & ~sc.next_escaped;
+            u64 maybe = potential << 1;
+            u64 code = ((maybe | odd_bits) - potential) ^ odd_bits;
+            escaped = code ^ (backslash | sc.next_escaped);
+            sc.next_escaped = (code & backslash) >> 63;
+        }
+
+        quote &= ~escaped;
+        u64 in_string = _json_prefix_xor(quote) ^ sc.in_string;
+        sc.in_string = (u64)((i64)in_string >> 63);
+
+        u64 scalar = ~(op | space | quote) & ~in_string & valid;
+        u64 scalar_start = scalar & ~((scalar << 1) | sc.scalar);
+        sc.scalar = scalar >> 63;
+
+        u64 structural = ((op & ~in_string) | (quote & in_string) | scalar_start) & valid;
+        while (structural) {
+            out[n++] = (u32)(base + bit_first(structural));
+            structural &= structural - 1;
+        }
+    }
+
+    if (sc.in_string) return -1;
+    return (isize)n;
+}
+
+/* DOM PARSER */
+
+typedef struct {
+    Arena *arena;
+    const u8 *p;
+    usize len;
+    u32 *idx;
+    usize n_idx;
+    usize pos;
+    JsonNode *nodes;
+    u32 n_nodes;
+    JsonResult error;
+    usize error_offset;
+} _JsonParser;
+
+static bool _json_fail(_JsonParser *ps, JsonResult error, usize offset) {
+    if (ps->error == JsonOk) {
+        ps->error = error;
+        ps->error_offset = offset;
+    }
+    return false;
+}
+
+static inline u8 _json_peek(_JsonParser *ps) {
+    return ps->pos < ps->n_idx ? ps->p[ps->idx[ps->pos]] : 0;
+}
+
+static inline usize _json_offset(_JsonParser *ps) {
+    return ps->pos < ps->n_idx ? ps->idx[ps->pos] : ps->len;
+}
+
+static bool _json_parse_string(_JsonParser *ps, JsonNode *node) {
+    usize start = ps->idx[ps->pos] + 1;
+    bool has_escape = false;
+    usize resume;
+    isize end = _json_string_end(ps->p + start, ps->len - start, &has_escape, &resume);
+    if (end < 0) return _json_fail(ps, JsonErrorString, start - 1);
+
+    node->type = JsonString;
+    node->text = (String){(char*)ps->p + start, (int)end};
+    if (has_escape) {
+        char *buf = (char*)arena_alloc(ps->arena, end + 1);
+        if (!buf) return _json_fail(ps, JsonErrorMemory, start - 1);
+        int n = _json_unescape(ps->p + start, end, buf);
+        if (n < 0) return _json_fail(ps, JsonErrorString, start - 1);
+        node->text = (String){buf, n};
+    }
+
+    ps->pos++;
+    return true;
+}
+
+static bool _json_parse_scalar(_JsonParser *ps, JsonNode *node) {
+    usize at = ps->idx[ps->pos];
+    const u8 *s = ps->p + at;
+    usize avail = ps->len - at;
+    usize used;
+
+    if (avail >= 4 && memcmp(s, "null", 4) == 0) {
+        node->type = JsonNull;
+        used = 4;
+    } else if (avail >= 4 && memcmp(s, "true", 4) == 0) {
+        node->type = JsonBool;
+        node->boolean = true;
+        used = 4;
+    } else if (avail >= 5 && memcmp(s, "false", 5) == 0) {
+        node->type = JsonBool;
+        used = 5;
+    } else if (_json_number_start(s, avail)) {
+        usize n = _json_number_len(s, avail);
+        if (!n || n > INT32_MAX || (n < avail && !_json_is_boundary(s[n]))) return _json_fail(ps, JsonErrorNumber, at);
+        ParseResult r = string_parse_f64((String){(char*)s, (int)n}, &node->number);
+        if (r != ParseOk && r != ParseOverflow) return _json_fail(ps, JsonErrorNumber, at);
+        node->type = JsonNumber;
+        node->text = (String){(char*)s, (int)n};
+        used = n;
+    } else {
+        return _json_fail(ps, JsonErrorSyntax, at);
+    }
+
+    if (used < avail && !_json_is_boundary(s[used])) return _json_fail(ps, JsonErrorSyntax, at + used);
+    ps->pos++;
+    return true;
+}
+
+static bool _json_parse_value(_JsonParser *ps, int depth) {
+    if (ps->pos >= ps->n_idx) return _json_fail(ps, JsonErrorSyntax, ps->len);
+    if (depth > JSON_MAX_DEPTH) return _json_fail(ps, JsonErrorDepth, _json_offset(ps));
+
+    u32 index = ps->n_nodes++;
+    JsonNode *node = &ps->nodes[index];
+    memset(node, 0, sizeof(*node));
+    u8 c = _json_peek(ps);
+
+    if (c == '{' || c == '[') {
+        bool object = c == '{';
+        u8 close = object ? '}' : ']';
+        node->type = object ? JsonObject : JsonArray;
+        ps->pos++;
+        if (_json_peek(ps) == close) {
+            ps->pos++;
+        } else {
+            for (;;) {
+                if (object) {
+                    if (_json_peek(ps) != '"') return _json_fail(ps, JsonErrorSyntax, _json_offset(ps));
+                    JsonNode *key = &ps->nodes[ps->n_nodes++];
+                    memset(key, 0, sizeof(*key));
+                    key->size = 1;
+                    if (!_json_parse_string(ps, key)) return false;
+                    if (_json_peek(ps) != ':') return _json_fail(ps, JsonErrorSyntax, _json_offset(ps));
+                    ps->pos++;
+                }
+                if (!_json_parse_value(ps, depth + 1)) return false;
+                ps->nodes[index].count++;
+
+                usize at = _json_offset(ps);
+                u8 next = _json_peek(ps);
+                ps->pos++;
+                if (next == close) break;
+                if (next != ',') return _json_fail(ps, JsonErrorSyntax, at);
+            }
+        }
+    } else if (c == '"') {
+        if (!_json_parse_string(ps, node)) return false;
+    } else if (c == ']' || c == '}' || c == ',' || c == ':') {
+        return _json_fail(ps, JsonErrorSyntax, _json_offset(ps));
+    } else {
+        if (!_json_parse_scalar(ps, node)) return false;
+    }
+
+    ps->nodes[index].size = ps->n_nodes - index;
+    return true;
+}
+
+// Parses input into doc, allocating from arena. String nodes point into input,
+// so it has to outlive the document. On failure doc->error_offset is the byte
+// offset where parsing stopped.
+static JsonResult json_parse(Arena *arena, String input, JsonDoc *doc) {
+    memset(doc, 0, sizeof(*doc));
+    usize len = input.len > 0 ? (usize)input.len : 0;
+    _JsonParser ps = {
+        .arena = arena,
+        .p = (const u8*)input.data,
+        .len = len,
+    };
+
+    ps.idx = (u32*)arena_alloc(arena, (len + 1) * sizeof(u32));
+    if (!ps.idx) return JsonErrorMemory;
+    isize n = _json_index(ps.p, len, ps.idx);
+    if (n < 0) {
+        doc->error_offset = len;
+        return JsonErrorString;
+    }
+    ps.n_idx = (usize)n;
+
+    // Every node starts at a structural offset, so this is an upper bound
+    ps.nodes = (JsonNode*)arena_alloc(arena, (ps.n_idx + 1) * sizeof(JsonNode));
+    if (!ps.nodes) return JsonErrorMemory;
+
+    if (_json_parse_value(&ps, 0) && ps.pos != ps.n_idx)
+        _json_fail(&ps, JsonErrorSyntax, _json_offset(&ps));
+
+    doc->nodes = ps.nodes;
+    doc->count = ps.n_nodes;
+    doc->error_offset = ps.error_offset;
+    return ps.error;
+}
+
+static JsonNode *json_root(JsonDoc *doc) {
+    return doc->count ? &doc->nodes[0] : NULL;
+}
+
+// for json_array_each(item, array) { ... }
+#define json_array_each(child, node) \
+    (JsonNode *child = (node) + 1; child < (node) + (node)->size; child += child->size)
+
+// for json_object_each(key, value, object) { ... }
+#define json_object_each(key, value, node) \
+    (JsonNode *key = (node) + 1, *value = key + 1; key < (node) + (node)->size; key = value + value->size, value = key + 1)
+
+// Element i of an array, or NULL. Walks the siblings, O(i).
+static JsonNode *json_array_at(JsonNode *array, u32 i) {
+    if (!array || array->type != JsonArray || i >= array->count) return NULL;
+    JsonNode *child = array + 1;
+    while (i--) child += child->size;
+    return child;
+}
+
+// Value of the first member named key, or NULL
+static JsonNode *json_object_get(JsonNode *object, String key) {
+    if (!object || object->type != JsonObject) return NULL;
+    for json_object_each(k, v, object) {
+        if (string_match(k->text, key)) return v;
+    }
+    return NULL;
+}
+
+/* PULL READER */
+
+typedef enum {
+    JsonTokenNone,
+    JsonTokenBeginObject,
+    JsonTokenEndObject,
+    JsonTokenBeginArray,
+    JsonTokenEndArray,
+    JsonTokenKey,
+    JsonTokenString,
+    JsonTokenNumber,
+    JsonTokenBool,
+    JsonTokenNull,
+    JsonTokenEnd,       // the top-level value is complete
+    JsonTokenError,     // see JsonReader.error / error_offset
+} JsonTokenType;
+
+typedef struct {
+    JsonTokenType type;
+    String text;    // key or string contents, number source. Valid until the next call.
+    f64 number;
+    bool boolean;
+    usize offset;   // byte offset of the token in the stream
+} JsonToken;
+
+// Fills buf with up to cap bytes, returns 0 at end of stream
+typedef usize (*JsonReadFn)(void *user, u8 *buf, usize cap);
+
+typedef enum {
+    _JsonExpectValue,
+    _JsonExpectValueOrEnd,
+    _JsonExpectKey,
+    _JsonExpectKeyOrEnd,
+    _JsonExpectColon,
+    _JsonExpectCommaOrEnd,
+    _JsonExpectDone,
+} _JsonExpect;
+
+// Streams tokens out of a document of any size. Memory stays at the window
+// size unless a single token is larger than the window.
+typedef struct {
+    Allocator *alloc;
+    JsonReadFn read;
+    void *user;
+    u8 *buf;
+    usize cap;
+    usize len;
+    usize pos;
+    usize base;         // stream offset of buf[0]
+    bool eof;
+    bool owns_buf;
+    char *scratch;      // unescaped strings
+    usize scratch_cap;
+    u8 stack[JSON_MAX_DEPTH];
+    int depth;
+    _JsonExpect expect;
+    JsonResult error;
+    usize error_offset;
+} JsonReader;
+
+static JsonReader json_reader_init(Allocator *alloc, JsonReadFn read, void *user, usize window) {
+    JsonReader r = {0};
+    r.alloc = alloc;
+    r.read = read;
+    r.user = user;
+    r.cap = window ? window : KB(64);
+    r.buf = (u8*)alloc->alloc(alloc, r.cap);
+    r.owns_buf = true;
+    if (!r.buf) r.error = JsonErrorMemory;
+    return r;
+}
+
+// Reads tokens straight out of an in-memory document
+static JsonReader json_reader_init_string(Allocator *alloc, String input) {
+    JsonReader r = {0};
+    r.alloc = alloc;
+    r.buf = (u8*)input.data;
+    r.cap = r.len = input.len;
+    r.eof = true;
+    return r;
+}
+
+static void json_reader_deinit(JsonReader *r) {
+    if (r->alloc->free) {
+        if (r->owns_buf && r->buf) r->alloc->free(r->alloc, r->buf);
+        if (r->scratch) r->alloc->free(r->alloc, r->scratch);
+    }
+    r->buf = NULL;
+    r->scratch = NULL;
+}
+
+// JsonReadFn over a File opened with file_open
+static usize json_read_file(void *user, u8 *buf, usize cap) {
+    File *f = (File*)user;
+    return fread(buf, 1, cap, f->fd);
+}
+
+// Makes at least n bytes available at buf + pos unless the stream ends first.
+// Returns false only on allocation failure.
+static bool _json_reader_fill(JsonReader *r, usize n) {
+    if (r->pos + n <= r->len || r->eof) return true;
+
+    if (r->pos) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->base += r->pos;
+        r->pos = 0;
+    }
+    if (n > r->cap) {
+        usize cap = r->cap * 2;
+        while (cap < n) cap *= 2;
+        u8 *buf = (u8*)r->alloc->realloc(r->alloc, r->buf, cap);
+        if (!buf) return false;
+        r->buf = buf;
+        r->cap = cap;
+    }
+    while (r->len < n && !r->eof) {
+        usize got = r->read(r->user, r->buf + r->len, r->cap - r->len);
+        if (got == 0) r->eof = true;
+        r->len += got;
+    }
+    return true;
+}
+
+static JsonTokenType _json_reader_fail(JsonReader *r, JsonResult error) {
+    r->error = error;
+    r->error_offset = r->base + r->pos;
+    return JsonTokenError;
+}
+
+// Skips whitespace, returns the next byte or 0 at end of stream
+static u8 _json_reader_peek(JsonReader *r) {
+    for (;;) {
+        while (r->pos < r->len) {
+            u8 c = r->buf[r->pos];
+            if (c != ' ' && c != '\t' && c != '\n' && c != '\r') return c;
+            r->pos++;
+        }
+        if (r->eof) return 0;
+        if (!_json_reader_fill(r, 1)) return 0;
+    }
+}
+
+static JsonTokenType _json_reader_string(JsonReader *r, JsonToken *tok) {
+    // Only the newly read bytes are scanned when the string spans refills
+    usize from = 0;
+    isize end;
+    bool has_escape = false;
+    for (;;) {
+        usize start = r->pos + 1;
+        usize resume;
+        end = _json_string_end(r->buf + start + from, r->len - start - from, &has_escape, &resume);
+        if (end >= 0) {
+            end += from;
+            break;
+        }
+        if (r->eof) return _json_reader_fail(r, JsonErrorString);
+        from += resume;
+        if (!_json_reader_fill(r, r->len - r->pos + 1)) return _json_reader_fail(r, JsonErrorMemory);
+    }
+
+    const u8 *s = r->buf + r->pos + 1;
+    tok->text = (String){(char*)s, (int)end};
+    if (has_escape) {
+        if ((usize)end + 1 > r->scratch_cap) {
+            usize cap = r->scratch_cap ? r->scratch_cap : 256;
+            while (cap < (usize)end + 1) cap *= 2;
+            char *scratch = r->scratch && r->alloc->realloc
+                ? (char*)r->alloc->realloc(r->alloc, r->scratch, cap)
+                : (char*)r->alloc->alloc(r->alloc, cap);
+            if (!scratch) return _json_reader_fail(r, JsonErrorMemory);
+            r->scratch = scratch;
+            r->scratch_cap = cap;
+        }
+        int n = _json_unescape(s, end, r->scratch);
+        if (n < 0) return _json_reader_fail(r, JsonErrorString);
+        tok->text = (String){r->scratch, n};
+    }
+    r->pos += end + 2;
+    return JsonTokenString;
+}
+
+static JsonTokenType _json_reader_scalar(JsonReader *r, JsonToken *tok) {
+    // Pull in bytes until the scalar is followed by a boundary or the end
+    usize n = 0;
+    for (;;) {
+        while (r->pos + n < r->len && !_json_is_boundary(r->buf[r->pos + n])) n++;
+        if (r->pos + n < r->len || r->eof) break;
+        if (!_json_reader_fill(r, n + 1)) return _json_reader_fail(r, JsonErrorMemory);
+    }
+
+    const u8 *s = r->buf + r->pos;
+    JsonTokenType type;
+    if (n == 4 && memcmp(s, "null", 4) == 0) {
+        type = JsonTokenNull;
+    } else if (n == 4 && memcmp(s, "true", 4) == 0) {
+        type = JsonTokenBool;
+        tok->boolean = true;
+    } else if (n == 5 && memcmp(s, "false", 5) == 0) {
+        type = JsonTokenBool;
+        tok->boolean = false;
+    } else if (n && _json_number_start(s, n)) {
+        if (_json_number_len(s, n) != n) return _json_reader_fail(r, JsonErrorNumber);
+        ParseResult res = string_parse_f64((String){(char*)s, (int)n}, &tok->number);
+        if (res != ParseOk && res != ParseOverflow) return _json_reader_fail(r, JsonErrorNumber);
+        type = JsonTokenNumber;
+    } else {
+        return _json_reader_fail(r, JsonErrorSyntax);
+    }
+
+    tok->text = (String){(char*)s, (int)n};
+    r->pos += n;
+    return type;
+}
+
+// Value finished: decide what may follow
+static void _json_reader_after_value(JsonReader *r) {
+    r->expect = r->depth ? _JsonExpectCommaOrEnd : _JsonExpectDone;
+}
+
+// Reads the next token. Returns its type, which is also stored in tok->type.
+static JsonTokenType json_reader_next(JsonReader *r, JsonToken *tok) {
+    memset(tok, 0, sizeof(*tok));
+    if (r->error != JsonOk) return tok->type = JsonTokenError;
+
+    u8 c = _json_reader_peek(r);
+    tok->offset = r->base + r->pos;
+
+    switch (r->expect) {
+    case _JsonExpectDone:
+        if (c) return tok->type = _json_reader_fail(r, JsonErrorSyntax);
+        return tok->type = JsonTokenEnd;
+
+    case _JsonExpectCommaOrEnd: {
+        u8 close = r->stack[r->depth - 1] == '{' ? '}' : ']';
+        if (c == ',') {
+            r->pos++;
+            r->expect = close == '}' ? _JsonExpectKey : _JsonExpectValue;
+            return json_reader_next(r, tok);
+        }
+        if (c != close) return tok->type = _json_reader_fail(r, JsonErrorSyntax);
+        r->pos++;
+        r->depth--;
+        _json_reader_after_value(r);
+        return tok->type = close == '}' ? JsonTokenEndObject : JsonTokenEndArray;
+    }
+
+    case _JsonExpectKeyOrEnd:
+        if (c == '}') {
+            r->pos++;
+            r->depth--;
+            _json_reader_after_value(r);
+            return tok->type = JsonTokenEndObject;
+        }
+        // fallthrough
+    case _JsonExpectKey:
+        if (c != '"') return tok->type = _json_reader_fail(r, JsonErrorSyntax);
+        if (_json_reader_string(r, tok) == JsonTokenError) return tok->type = JsonTokenError;
+        // The ':' is consumed by the next call, peeking now could refill the
+        // window and move the key out from under tok->text
+        r->expect = _JsonExpectColon;
+        return tok->type = JsonTokenKey;
+
+    case _JsonExpectColon:
+        if (c != ':') return tok->type = _json_reader_fail(r, JsonErrorSyntax);
+        r->pos++;
+        c = _json_reader_peek(r);
+        tok->offset = r->base + r->pos;
+        break;
+
+    case _JsonExpectValueOrEnd:
+        if (c == ']') {
+            r->pos++;
+            r->depth--;
+            _json_reader_after_value(r);
+            return tok->type = JsonTokenEndArray;
+        }
+        // fallthrough
+    case _JsonExpectValue:
+        break;
+    }
+
+    if (c == '{' || c == '[') {
+        if (r->depth >= JSON_MAX_DEPTH) return tok->type = _json_reader_fail(r, JsonErrorDepth);
+        r->stack[r->depth++] = c;
+        r->pos++;
+        r->expect = c == '{' ? _JsonExpectKeyOrEnd : _JsonExpectValueOrEnd;
+        return tok->type = c == '{' ? JsonTokenBeginObject : JsonTokenBeginArray;
+    }
+
+    JsonTokenType type;
+    if (c == '"') type = _json_reader_string(r, tok);
+    else if (c == 0) type = _json_reader_fail(r, JsonErrorSyntax);
+    else type = _json_reader_scalar(r, tok);
+
+    if (type != JsonTokenError) _json_reader_after_value(r);
+    return tok->type = type;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef LINES_H
+#define LINES_H
+
+// Offset index over the lines of a large buffer, built in parallel. Once built,
+// line N is an O(1) lookup and nothing is copied out of the buffer.
+
+#include "allocator.h"
+#include "log.h"
+#include "simd.h"
+#include "strings.h"
+#include "thread.h"
+#include "types.h"
+
+#include <stdint.h>
+
+// Chunk of the buffer scanned by one task
+#define LINE_INDEX_CHUNK (1 << 20)
+
+// Lines are split on '\n' like LineIter, with a trailing '\r' dropped on
+// lookup. Offsets are u32 when the buffer is under 4GiB, otherwise u64.
+typedef struct {
+    const char *data;
+    usize len;
+    usize count;        // number of lines
+    u32 *offsets32;     // count + 1 line starts, the last one a sentinel
+    u64 *offsets64;
+} LineIndex;
+
+typedef struct {
+    LineIndex *index;
+    usize chunk_count;
+    usize *newlines;    // per chunk: newline count, then the prefix sum
+} _LineIndexBuild;
+
+static void _line_index_count(void *ctx, usize chunk) {
+    _LineIndexBuild *b = (_LineIndexBuild*)ctx;
+    usize start = chunk * LINE_INDEX_CHUNK;
+    usize end = start + LINE_INDEX_CHUNK < b->index->len ? start + LINE_INDEX_CHUNK : b->index->len;
+    b->newlines[chunk] = mem_count_byte(b->index->data + start, end - start, '\n');
+}
+
+static inline void _line_index_store(LineIndex *idx, usize slot, usize offset) {
+    if (idx->offsets32) idx->offsets32[slot] = (u32)offset;
+    else idx->offsets64[slot] = offset;
+}
+
+static void _line_index_fill(void *ctx, usize chunk) {
+    _LineIndexBuild *b = (_LineIndexBuild*)ctx;
+    LineIndex *idx = b->index;
+    const u8 *p = (const u8*)idx->data;
+    usize start = chunk * LINE_INDEX_CHUNK;
+    usize end = start + LINE_INDEX_CHUNK < idx->len ? start + LINE_INDEX_CHUNK : idx->len;
+    // Slot 0 is line 0; the newline before line k fills slot k
+    usize slot = b->newlines[chunk] + 1;
+
+    usize i = start;
+#if SIMD_WIDTH
+    SimdVec nl = simd_splat('\n');
+    for (; i + SIMD_WIDTH <= end; i += SIMD_WIDTH) {
+        u32 mask = simd_mask(simd_eq(simd_load(p + i), nl));
+        while (mask) {
+            _line_index_store(idx, slot++, i + bit_first(mask) + 1);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < end; ++i) {
+        if (p[i] == '\n') _line_index_store(idx, slot++, i + 1);
+    }
+}
+
+// Indexes the lines of [data, data + len) using up to threads threads (0 for
+// one per CPU). The buffer must outlive the index.
+static bool line_index_build(Allocator *alloc, LineIndex *idx, const char *data, usize len, int threads) {
+    *idx = (LineIndex){.data = data, .len = len};
+    if (len == 0) return true;
+
+    _LineIndexBuild b = {.index = idx};
+    b.chunk_count = (len + LINE_INDEX_CHUNK - 1) / LINE_INDEX_CHUNK;
+    b.newlines = (usize*)alloc->alloc(alloc, b.chunk_count * sizeof(usize));
+    if (!b.newlines) {
+        err("Allocation failed\n");
+        return false;
+    }
+
+    parallel_for(threads, b.chunk_count, _line_index_count, &b);
+
+    usize total = 0;
+    for (usize i = 0; i < b.chunk_count; ++i) {
+        usize n = b.newlines[i];
+        b.newlines[i] = total;
+        total += n;
+    }
+    // A terminator at the very end doesn't open another line
+    bool terminated = data[len - 1] == '\n';
+    idx->count = total + 1 - terminated;
+
+    // The sentinel is len + 1 when unterminated, so it must fit as well
+    if (len < UINT32_MAX)
+        idx->offsets32 = (u32*)alloc->alloc(alloc, (idx->count + 1) * sizeof(u32));
+    else
+        idx->offsets64 = (u64*)alloc->alloc(alloc, (idx->count + 1) * sizeof(u64));
+    if (!idx->offsets32 && !idx->offsets64) {
+        err("Allocation failed\n");
+        if (alloc->free) alloc->free(alloc, b.newlines);
+        return false;
+    }
+
+    _line_index_store(idx, 0, 0);
+    // When terminated, the last newline writes the sentinel (len) itself
+    if (!terminated) _line_index_store(idx, idx->count, len + 1);
+    parallel_for(threads, b.chunk_count, _line_index_fill, &b);
+
+    if (alloc->free) alloc->free(alloc, b.newlines);
+    return true;
+}
+
+static inline usize _line_index_offset(const LineIndex *idx, usize slot) {
+    return idx->offsets32 ? idx->offsets32[slot] : idx->offsets64[slot];
+}
+
+// Line n without its terminator, or an empty String when out of range
+static String line_index_get(const LineIndex *idx, usize n) {
+    if (n >= idx->count) return (String){0};
+    usize start = _line_index_offset(idx, n);
+    usize end = _line_index_offset(idx, n + 1) - 1;
+    // Only a '\r' before a '\n' is part of the terminator
+    if (end < idx->len && end > start && idx->data[end - 1] == '\r') end--;
+    return (String){.data = (char*)idx->data + start, .len = (int)(end - start)};
+}
+
+// Number of the line containing byte offset, e.g. for error positions
+static usize line_index_line_at(const LineIndex *idx, usize offset) {
+    usize lo = 0, hi = idx->count;
+    while (hi - lo > 1) {
+        usize mid = lo + (hi - lo) / 2;
+        if (_line_index_offset(idx, mid) <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void line_index_deinit(Allocator *alloc, LineIndex *idx) {
+    if (alloc->free) {
+        alloc->free(alloc, idx->offsets32);
+        alloc->free(alloc, idx->offsets64);
+    }
+    *idx = (LineIndex){0};
+}
+
+#endif
@@ -1,13 +1,43 @@
+#ifndef LOG_H
+#define LOG_H
+
 #include <stdio.h>
 #include <signal.h>
+#include <stdarg.h>
 
 #ifndef APP_NAME
 #define APP_NAME ""
 #endif
 
-#define print(fmt, args...) printf("%s: (%s:%d): " fmt, APP_NAME, __func__, __LINE__, ## args, NULL)
+// Define LOG_STRING_VIEWS before including cbase to route print/println/err
+// through stb_sprintf, so they accept %S/%lS String views. That needs the
+// stb_sprintf implementation, which strings.h provides, and gives up the
+// compiler's printf format checking since %S isn't a standard specifier.
+#ifdef LOG_STRING_VIEWS
+#include "stb_sprintf.h"
+
+static char *_log_write_cb(const char *buf, void *user, int len) {
+    fwrite(buf, 1, len, (FILE*)user);
+    return (char*)buf;
+}
+
+static int log_printf(FILE *out, const char *fmt, ...) {
+    char buf[STB_SPRINTF_MIN];
+    va_list args;
+    va_start(args, fmt);
+    int len = stbsp_vsprintfcb(_log_write_cb, out, buf, fmt, args);
+    va_end(args);
+    return len;
+}
+
+#define _log_fprintf log_printf
+#else
+#define _log_fprintf fprintf
+#endif
+
+#define print(fmt, args...) _log_fprintf(stdout, "%s: (%s:%d): " fmt, APP_NAME, __func__, __LINE__, ## args, NULL)
 
-#define println(fmt, args...) printf("%s: (%s:%d): " fmt "\n", APP_NAME, __func__, __LINE__, ## args, NULL)
+#define println(fmt, args...) _log_fprintf(stdout, "%s: (%s:%d): " fmt "\n", APP_NAME, __func__, __LINE__, ## args, NULL)
 
 #ifndef NDEBUG
 #define dbg(fmt, args...) print(fmt, ##args)
@@ -15,7 +45,8 @@
 #define dbg
 #endif
 
-#define err(fmt, args...) fprintf(stderr, "%s: (%s:%d): ERROR " fmt, APP_NAME, __func__, __LINE__, ## args, NULL)
+#define err(fmt, args...) _log_fprintf(stderr, "%s: (%s:%d): ERROR " fmt, APP_NAME, __func__, __LINE__, ## args, NULL)
 
 #define BREAKPOINT raise(SIGINT)
 
+#endif
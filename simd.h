@@ -0,0 +1,57 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Thin byte-wise SIMD layer used by the string scanners.
+// Picks AVX2 or SSE2 depending on the target, otherwise SIMD_WIDTH is 0 and
+// callers fall back to their scalar loops.
+
+#include "types.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 32
+typedef __m256i SimdVec;
+
+static inline SimdVec simd_load(const void *p) { return _mm256_loadu_si256((const __m256i*)p); }
+static inline SimdVec simd_splat(u8 c) { return _mm256_set1_epi8((char)c); }
+static inline SimdVec simd_eq(SimdVec a, SimdVec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline SimdVec simd_and(SimdVec a, SimdVec b) { return _mm256_and_si256(a, b); }
+static inline SimdVec simd_or(SimdVec a, SimdVec b) { return _mm256_or_si256(a, b); }
+static inline SimdVec simd_gt(SimdVec a, SimdVec b) { return _mm256_cmpgt_epi8(a, b); } // signed
+static inline u32 simd_mask(SimdVec a) { return (u32)_mm256_movemask_epi8(a); }
+
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_WIDTH 16
+typedef __m128i SimdVec;
+
+static inline SimdVec simd_load(const void *p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline SimdVec simd_splat(u8 c) { return _mm_set1_epi8((char)c); }
+static inline SimdVec simd_eq(SimdVec a, SimdVec b) { return _mm_cmpeq_epi8(a, b); }
+static inline SimdVec simd_and(SimdVec a, SimdVec b) { return _mm_and_si128(a, b); }
+static inline SimdVec simd_or(SimdVec a, SimdVec b) { return _mm_or_si128(a, b); }
+static inline SimdVec simd_gt(SimdVec a, SimdVec b) { return _mm_cmpgt_epi8(a, b); } // signed
+static inline u32 simd_mask(SimdVec a) { return (u32)_mm_movemask_epi8(a); }
+
+#else
+#define SIMD_WIDTH 0
+#endif
+
+// Kernels that need more than the portable ops above check these directly
+#if defined(__AVX2__)
+#define SIMD_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SIMD_SSE2 1
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <tmmintrin.h>
+#define SIMD_SSSE3 1
+#endif
+
+// Index of the lowest/highest set bit. Undefined for 0.
+static inline int bit_first(u64 mask) { return __builtin_ctzll(mask); }
+static inline int bit_last(u64 mask) { return 63 - __builtin_clzll(mask); }
+
+#endif
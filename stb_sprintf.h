@@ -2,7 +2,7 @@
 // originally by Jeff Roberts / RAD Game Tools, 2015/10/20
 // http://github.com/nothings/stb
 //
-// allowed types:  sc uidBboXx p AaGgEef n
+// allowed types:  sc uidBboXx p AaGgEef n S
 // lengths      :  hh h ll j z t I64 I32 I
 //
 // Contributors:
@@ -83,6 +83,14 @@ int stbsp_vsprintfcb( STBSP_SPRINTFCB * callback, void * user, char * buf, char
 void stbsp_set_separators( char comma, char period )
   Set the comma and period characters to use.
 
+STRING VIEWS:
+=============
+%S prints a cbase String ({char *data; int len}) passed by value, reading
+exactly len bytes with no strlen. Width, precision and '-' work as with %s.
+%lS prints a String16 ({uint16_t *data; int len}), transcoding its native
+order UTF-16 to UTF-8. Unpaired surrogates are printed as U+FFFD. Width,
+precision and '-' are ignored for %lS.
+
 FLOATS/DOUBLES:
 ===============
 This code uses a internal float->ascii conversion method that uses
@@ -201,6 +209,10 @@ PERFORMANCE vs MSVC 2008 32-/64-bit (GCC is even slower than MSVC):
 #endif
 typedef char *STBSP_SPRINTFCB(const char *buf, void *user, int len);
 
+// layout-compatible with cbase String / String16, consumed by %S and %lS
+typedef struct { char *data; int len; } stbsp__string;
+typedef struct { unsigned short *data; int len; } stbsp__string16;
+
 #ifndef STB_SPRINTF_DECORATE
 #define STB_SPRINTF_DECORATE(name) stbsp_##name // define this before including if you want to change the names
 #endif
@@ -600,6 +612,50 @@ STBSP__PUBLICDEF int STB_SPRINTF_DECORATE(vsprintfcb)(STBSP_SPRINTFCB *callback,
          // copy the string in
          goto scopy;
 
+      case 'S':
+         if (f[-1] == 'l') {
+            stbsp__string16 w = va_arg(va, stbsp__string16);
+            stbsp__int32 k;
+            for (k = 0; k < w.len; ++k) {
+               stbsp__uint32 c = w.data[k];
+               if (c >= 0xd800 && c < 0xdc00 && k + 1 < w.len && w.data[k + 1] >= 0xdc00 && w.data[k + 1] < 0xe000) {
+                  c = 0x10000 + ((c - 0xd800) << 10) + (w.data[k + 1] - 0xdc00);
+                  ++k;
+               } else if (c >= 0xd800 && c < 0xe000) {
+                  c = 0xfffd;
+               }
+               stbsp__chk_cb_buf(4);
+               if (c < 0x80) {
+                  *bf++ = (char)c;
+               } else if (c < 0x800) {
+                  *bf++ = (char)(0xc0 | (c >> 6));
+                  *bf++ = (char)(0x80 | (c & 0x3f));
+               } else if (c < 0x10000) {
+                  *bf++ = (char)(0xe0 | (c >> 12));
+                  *bf++ = (char)(0x80 | ((c >> 6) & 0x3f));
+                  *bf++ = (char)(0x80 | (c & 0x3f));
+               } else {
+                  *bf++ = (char)(0xf0 | (c >> 18));
+                  *bf++ = (char)(0x80 | ((c >> 12) & 0x3f));
+                  *bf++ = (char)(0x80 | ((c >> 6) & 0x3f));
+                  *bf++ = (char)(0x80 | (c & 0x3f));
+               }
+            }
+            break;
+         } else {
+            stbsp__string v = va_arg(va, stbsp__string);
+            s = v.data;
+            l = (v.data && v.len > 0) ? (stbsp__uint32)v.len : 0;
+            if (pr >= 0 && (stbsp__uint32)pr < l)
+               l = (stbsp__uint32)pr;
+         }
+         lead[0] = 0;
+         tail[0] = 0;
+         pr = 0;
+         dp = 0;
+         cs = 0;
+         goto scopy;
+
       case 'c': // char
          // get the character
          s = num + STBSP__NUMSZ - 1;
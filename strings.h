@@ -3,9 +3,11 @@
 
 #include "allocator.h"
 #include "log.h"
+#include "simd.h"
 #include "types.h"
 #define STB_SPRINTF_IMPLEMENTATION
 #include "stb_sprintf.h"
+#include <limits.h>
 #include <stdio.h>
 #include <wchar.h>
 
@@ -64,38 +66,661 @@ static String string_from_bytes(u8 *bytes, int len) {
     };
 }
 
-// returns endianness of string, or -1 for no given byte order
+// Returns a view into str of [start, end), clamped to the bounds of str
+static String string_slice(String str, int start, int end) {
+    if (start < 0) start = 0;
+    if (end > str.len) end = str.len;
+    if (start >= end) return (String){.data = str.data + (start < str.len ? start : str.len), .len = 0};
+    return (String){
+        .data = str.data + start,
+        .len = end - start,
+    };
+}
+
+/* UTF-16 <-> UTF-8 */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define UTF16_NATIVE Utf16Be
+#else
+#define UTF16_NATIVE Utf16Le
+#endif
+
+// Returns the byte order signalled by a BOM, or -1 for no BOM. first_char is
+// the first code unit as loaded in host order.
 static Utf16BOM string16_bom(const uint16_t first_char) {
-    if (first_char == 0xfffe)
-        return Utf16Le;
     if (first_char == 0xfeff)
-        return Utf16Be;
+        return UTF16_NATIVE;
+    if (first_char == 0xfffe)
+        return UTF16_NATIVE == Utf16Le ? Utf16Be : Utf16Le;
 
     return Utf16None;
 }
 
+// Decodes one codepoint from p. Returns the number of bytes consumed (at least
+// 1 when len > 0); malformed sequences decode to U+FFFD one byte at a time.
+static int utf8_decode(const u8 *p, usize len, u32 *cp) {
+    u8 c = p[0];
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+
+    int n;
+    u32 min;
+    if (c >= 0xc2 && c <= 0xdf) { n = 2; min = 0x80; *cp = c & 0x1f; }
+    else if (c >= 0xe0 && c <= 0xef) { n = 3; min = 0x800; *cp = c & 0x0f; }
+    else if (c >= 0xf0 && c <= 0xf4) { n = 4; min = 0x10000; *cp = c & 0x07; }
+    else { *cp = 0xfffd; return 1; }
+
+    if ((usize)n > len) { *cp = 0xfffd; return 1; }
+    for (int i = 1; i < n; ++i) {
+        if ((p[i] & 0xc0) != 0x80) { *cp = 0xfffd; return 1; }
+        *cp = (*cp << 6) | (p[i] & 0x3f);
+    }
+    if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp < 0xe000)) {
+        *cp = 0xfffd;
+        return 1;
+    }
+    return n;
+}
+
+// Writes cp as UTF-8 to out (when not NULL), returns the encoded length
+static int utf8_encode(char *out, u32 cp) {
+    if (cp < 0x80) {
+        if (out) out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        if (out) {
+            out[0] = (char)(0xc0 | (cp >> 6));
+            out[1] = (char)(0x80 | (cp & 0x3f));
+        }
+        return 2;
+    }
+    if (cp < 0x10000) {
+        if (out) {
+            out[0] = (char)(0xe0 | (cp >> 12));
+            out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+            out[2] = (char)(0x80 | (cp & 0x3f));
+        }
+        return 3;
+    }
+    if (out) {
+        out[0] = (char)(0xf0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[3] = (char)(0x80 | (cp & 0x3f));
+    }
+    return 4;
+}
+
+static inline u16 _utf16_load(const u8 *p, bool be) {
+    return be ? (u16)((p[0] << 8) | p[1]) : (u16)(p[0] | (p[1] << 8));
+}
+
+static inline void _utf16_store(u8 *p, u16 c, bool be) {
+    p[be ? 1 : 0] = (u8)c;
+    p[be ? 0 : 1] = (u8)(c >> 8);
+}
+
+// Transcodes units UTF-16 code units to UTF-8. With out == NULL only the output
+// length is computed, so the counting and writing passes can never disagree.
+// A trailing high surrogate is left in *pending (when non-NULL) for the next
+// chunk instead of being emitted; otherwise unpaired surrogates become U+FFFD.
+static usize _utf16_to_utf8(const u8 *in, usize units, bool be, char *out, u32 *pending) {
+    usize written = 0;
+    usize i = 0;
+
+    if (pending && *pending && units) {
+        u16 lo = _utf16_load(in, be);
+        if (lo >= 0xdc00 && lo < 0xe000) {
+            u32 cp = 0x10000 + ((*pending - 0xd800) << 10) + (lo - 0xdc00);
+            written += utf8_encode(out ? out + written : NULL, cp);
+            i = 1;
+        } else {
+            written += utf8_encode(out ? out + written : NULL, 0xfffd);
+        }
+        *pending = 0;
+    }
+
+    while (i < units) {
+#if SIMD_AVX2
+        // 32 ASCII units at a time: all high bits clear, pack down to bytes
+        for (; i + 32 <= units; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(in + i * 2));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(in + i * 2 + 32));
+            if (be) {
+                a = _mm256_or_si256(_mm256_slli_epi16(a, 8), _mm256_srli_epi16(a, 8));
+                b = _mm256_or_si256(_mm256_slli_epi16(b, 8), _mm256_srli_epi16(b, 8));
+            }
+            __m256i hi = _mm256_and_si256(_mm256_or_si256(a, b), _mm256_set1_epi16((short)0xff80));
+            if (!_mm256_testz_si256(hi, hi)) break;
+            if (out) {
+                __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+                _mm256_storeu_si256((__m256i*)(out + written), packed);
+            }
+            written += 32;
+        }
+#endif
+#if SIMD_SSE2
+        for (; i + 16 <= units; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(in + i * 2));
+            __m128i b = _mm_loadu_si128((const __m128i*)(in + i * 2 + 16));
+            if (be) {
+                a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+                b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+            }
+            __m128i hi = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16((short)0xff80));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(hi, _mm_setzero_si128())) != 0xffff) break;
+            if (out) _mm_storeu_si128((__m128i*)(out + written), _mm_packus_epi16(a, b));
+            written += 16;
+        }
+#endif
+        // Scalar until the next ASCII run, so the vector loop gets another go
+        for (; i < units; ++i) {
+            u32 c = _utf16_load(in + i * 2, be);
+            if (c < 0x80) {
+                if (out) out[written] = (char)c;
+                written++;
+                if (i + 1 < units && _utf16_load(in + i * 2 + 2, be) < 0x80) {
+                    ++i;
+                    break;
+                }
+                continue;
+            }
+            if (c >= 0xd800 && c < 0xdc00) {
+                if (i + 1 == units && pending) {
+                    *pending = c;
+                    continue;
+                }
+                u32 lo = i + 1 < units ? _utf16_load(in + i * 2 + 2, be) : 0;
+                if (lo >= 0xdc00 && lo < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                    ++i;
+                } else {
+                    c = 0xfffd;
+                }
+            } else if (c >= 0xdc00 && c < 0xe000) {
+                c = 0xfffd;
+            }
+            written += utf8_encode(out ? out + written : NULL, c);
+        }
+    }
+
+    return written;
+}
+
+// Transcodes UTF-8 to UTF-16 code units in the given byte order. With out ==
+// NULL only the number of code units is computed. Malformed input becomes
+// U+FFFD; a sequence cut off by the end of the input is left unconsumed and
+// its length reported through *tail when tail is non-NULL.
+static usize _utf8_to_utf16(const u8 *in, usize len, bool be, u8 *out, usize *tail) {
+    usize units = 0;
+    usize i = 0;
+    if (tail) *tail = 0;
+
+    while (i < len) {
+#if SIMD_AVX2
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+            if (_mm_movemask_epi8(v)) break;
+            if (out) {
+                __m256i w = _mm256_cvtepu8_epi16(v);
+                if (be) w = _mm256_slli_epi16(w, 8);
+                _mm256_storeu_si256((__m256i*)(out + units * 2), w);
+            }
+            units += 16;
+        }
+#elif SIMD_SSE2
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+            if (_mm_movemask_epi8(v)) break;
+            if (out) {
+                __m128i lo = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+                __m128i hi = _mm_unpackhi_epi8(v, _mm_setzero_si128());
+                if (be) {
+                    lo = _mm_slli_epi16(lo, 8);
+                    hi = _mm_slli_epi16(hi, 8);
+                }
+                _mm_storeu_si128((__m128i*)(out + units * 2), lo);
+                _mm_storeu_si128((__m128i*)(out + units * 2 + 16), hi);
+            }
+            units += 16;
+        }
+#endif
+        for (; i < len; ) {
+            u8 c = in[i];
+            if (c < 0x80) {
+                if (out) _utf16_store(out + units * 2, c, be);
+                units++;
+                i++;
+                if (i < len && in[i] < 0x80) break;
+                continue;
+            }
+
+            // Leave a truncated but so far valid sequence for the next chunk
+            if (tail) {
+                int need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+                if (c >= 0xc2 && c <= 0xf4 && i + need > len) {
+                    bool prefix = true;
+                    for (usize k = i + 1; k < len; ++k) prefix &= (in[k] & 0xc0) == 0x80;
+                    if (prefix) {
+                        *tail = len - i;
+                        return units;
+                    }
+                }
+            }
+
+            u32 cp;
+            i += utf8_decode(in + i, len - i, &cp);
+            if (cp >= 0x10000) {
+                if (out) {
+                    _utf16_store(out + units * 2, (u16)(0xd800 + ((cp - 0x10000) >> 10)), be);
+                    _utf16_store(out + units * 2 + 2, (u16)(0xdc00 + ((cp - 0x10000) & 0x3ff)), be);
+                }
+                units += 2;
+            } else {
+                if (out) _utf16_store(out + units * 2, (u16)cp, be);
+                units++;
+            }
+        }
+    }
+
+    return units;
+}
+
+// Number of UTF-8 bytes needed to hold utf16 (not counting a terminator)
+static usize utf16_to_utf8_len(Utf16BOM byte_order, const u8 *utf16, usize utf16_size) {
+    return _utf16_to_utf8(utf16, utf16_size / 2, byte_order == Utf16Be, NULL, NULL);
+}
+
+// Transcodes UTF-16 bytes in the given order (Utf16None reads little endian)
+// into an exactly-sized, null-terminated UTF-8 String. A leading BOM is dropped.
 static String string_from_utf16(Allocator *alloc, Utf16BOM byte_order, uint8_t *utf16, size_t utf16_size) {
-    String str = {.len = 0};
-    char *ptr = str.data = alloc->alloc(alloc, utf16_size / 2 + 1);
+    bool be = byte_order == Utf16Be;
+    if (utf16_size >= 2 && _utf16_load(utf16, be) == 0xfeff) {
+        utf16 += 2;
+        utf16_size -= 2;
+    }
+
+    usize units = utf16_size / 2;
+    usize len = _utf16_to_utf8(utf16, units, be, NULL, NULL);
+    char *data = (char*)alloc->alloc(alloc, len + 1);
+    if (!data) {
+        err("Allocation failed\n");
+        return (String){0};
+    }
+    _utf16_to_utf8(utf16, units, be, data, NULL);
+    data[len] = 0;
+
+    return (String){
+        .data = data,
+        .len = (int)len,
+    };
+}
+
+// Number of UTF-16 code units needed to hold str
+static usize utf8_to_utf16_len(String str) {
+    return _utf8_to_utf16((const u8*)str.data, str.len, false, NULL, NULL);
+}
+
+// Transcodes UTF-8 into an exactly-sized, zero-terminated String16 whose units
+// are stored in the given byte order (Utf16None means host order)
+static String16 string16_from_utf8(Allocator *alloc, Utf16BOM byte_order, String str) {
+    if (byte_order == Utf16None) byte_order = UTF16_NATIVE;
+    bool be = byte_order == Utf16Be;
+    usize units = _utf8_to_utf16((const u8*)str.data, str.len, be, NULL, NULL);
+    u16 *data = (u16*)alloc->alloc(alloc, (units + 1) * sizeof(u16));
+    if (!data) {
+        err("Allocation failed\n");
+        return (String16){0};
+    }
+    _utf8_to_utf16((const u8*)str.data, str.len, be, (u8*)data, NULL);
+    data[units] = 0;
+
+    return (String16){
+        .data = data,
+        .len = (int)units,
+    };
+}
+
+/* Streaming UTF-16 -> UTF-8, for input that arrives in arbitrary chunks */
+
+// Worst-case UTF-8 output of one utf16_decoder_feed call with size input bytes
+#define UTF16_DECODE_MAX(size) ((((usize)(size)) / 2 + 2) * 3)
+
+typedef struct {
+    bool be;
+    bool has_byte;  // odd byte left over from the previous chunk
+    u8 byte;
+    u32 pending;    // high surrogate waiting for its pair
+} Utf16Decoder;
+
+static Utf16Decoder utf16_decoder_init(Utf16BOM byte_order) {
+    return (Utf16Decoder){.be = byte_order == Utf16Be};
+}
+
+// Decodes the next chunk into out, which must hold UTF16_DECODE_MAX(size)
+// bytes. Returns the number of bytes written.
+static usize utf16_decoder_feed(Utf16Decoder *d, const u8 *chunk, usize size, char *out) {
+    usize written = 0;
+    if (d->has_byte && size) {
+        u8 pair[2] = {d->byte, chunk[0]};
+        written += _utf16_to_utf8(pair, 1, d->be, out, &d->pending);
+        d->has_byte = false;
+        chunk++;
+        size--;
+    }
+
+    usize units = size / 2;
+    written += _utf16_to_utf8(chunk, units, d->be, out + written, &d->pending);
+    if (size & 1) {
+        d->byte = chunk[size - 1];
+        d->has_byte = true;
+    }
+    return written;
+}
+
+// Flushes a dangling high surrogate as U+FFFD. out must hold 3 bytes.
+static usize utf16_decoder_finish(Utf16Decoder *d, char *out) {
+    usize written = 0;
+    if (d->pending) written = utf8_encode(out, 0xfffd);
+    *d = utf16_decoder_init(d->be ? Utf16Be : Utf16Le);
+    return written;
+}
 
-    switch (byte_order) {
-    case Utf16None:
-    case Utf16Le:
-        for (int i = 0; i < utf16_size; i += 2, ptr++, str.len++) {
-            uint16_t c = *(uint16_t*)&utf16[i];
-            *ptr = (char)c;
+/* Streaming UTF-8 -> UTF-16 */
+
+// Worst-case UTF-16 output, in code units, of one utf8_encoder_feed call
+#define UTF8_ENCODE_MAX(size) ((usize)(size) + 4)
+
+typedef struct {
+    bool be;
+    u8 tail[4];     // incomplete sequence left over from the previous chunk
+    int tail_len;
+} Utf8Encoder;
+
+static Utf8Encoder utf8_encoder_init(Utf16BOM byte_order) {
+    if (byte_order == Utf16None) byte_order = UTF16_NATIVE;
+    return (Utf8Encoder){.be = byte_order == Utf16Be};
+}
+
+// Encodes the next UTF-8 chunk as UTF-16 bytes into out, which must hold
+// UTF8_ENCODE_MAX(size) code units. Returns the number of code units written.
+static usize utf8_encoder_feed(Utf8Encoder *e, const u8 *chunk, usize size, u8 *out) {
+    usize units = 0;
+    usize tail = 0;
+    while (e->tail_len && size) {
+        e->tail[e->tail_len++] = *chunk++;
+        size--;
+        units += _utf8_to_utf16(e->tail, e->tail_len, e->be, out + units * 2, &tail);
+        if (tail == 0) {
+            e->tail_len = 0;
+        } else if (tail < (usize)e->tail_len) {
+            // part of the carried bytes were flushed as replacement chars
+            memmove(e->tail, e->tail + e->tail_len - tail, tail);
+            e->tail_len = (int)tail;
         }
-        *ptr = 0;
-        break;
-    case Utf16Be:
-        for (int i = 0; i < utf16_size; i += 2, ptr++, str.len++) {
-            *ptr = utf16[i]; // just ignore lsb lol
+    }
+
+    units += _utf8_to_utf16(chunk, size, e->be, out + units * 2, &tail);
+    if (tail) {
+        memcpy(e->tail, chunk + size - tail, tail);
+        e->tail_len = (int)tail;
+    }
+    return units;
+}
+
+// Flushes an incomplete trailing sequence as U+FFFD. out must hold 4 units.
+static usize utf8_encoder_finish(Utf8Encoder *e, u8 *out) {
+    usize units = 0;
+    if (e->tail_len) units = _utf8_to_utf16(e->tail, e->tail_len, e->be, out, NULL);
+    e->tail_len = 0;
+    return units;
+}
+
+/* UTF-8 VALIDATION AND ITERATION */
+
+// Validation follows Keiser & Lemire's lookup-table scheme: three nibble
+// lookups on each byte and its predecessor classify every 2-byte window, and
+// the 3rd/4th continuation bytes are checked against the lead bytes 2-3 back.
+#define _UTF8_TOO_SHORT (1 << 0)
+#define _UTF8_TOO_LONG (1 << 1)
+#define _UTF8_OVERLONG_3 (1 << 2)
+#define _UTF8_TOO_LARGE (1 << 3)
+#define _UTF8_SURROGATE (1 << 4)
+#define _UTF8_OVERLONG_2 (1 << 5)
+#define _UTF8_TOO_LARGE_1000 (1 << 6)
+#define _UTF8_OVERLONG_4 (1 << 6)
+#define _UTF8_TWO_CONTS (1 << 7)
+#define _UTF8_CARRY (_UTF8_TOO_SHORT | _UTF8_TOO_LONG | _UTF8_TWO_CONTS)
+
+#define _UTF8_BYTE_1_HIGH \
+    _UTF8_TOO_LONG, _UTF8_TOO_LONG, _UTF8_TOO_LONG, _UTF8_TOO_LONG, \
+    _UTF8_TOO_LONG, _UTF8_TOO_LONG, _UTF8_TOO_LONG, _UTF8_TOO_LONG, \
+    _UTF8_TWO_CONTS, _UTF8_TWO_CONTS, _UTF8_TWO_CONTS, _UTF8_TWO_CONTS, \
+    _UTF8_TOO_SHORT | _UTF8_OVERLONG_2, \
+    _UTF8_TOO_SHORT, \
+    _UTF8_TOO_SHORT | _UTF8_OVERLONG_3 | _UTF8_SURROGATE, \
+    _UTF8_TOO_SHORT | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000 | _UTF8_OVERLONG_4
+
+#define _UTF8_BYTE_1_LOW \
+    _UTF8_CARRY | _UTF8_OVERLONG_3 | _UTF8_OVERLONG_2 | _UTF8_OVERLONG_4, \
+    _UTF8_CARRY | _UTF8_OVERLONG_2, \
+    _UTF8_CARRY, \
+    _UTF8_CARRY, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000 | _UTF8_SURROGATE, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000, \
+    _UTF8_CARRY | _UTF8_TOO_LARGE | _UTF8_TOO_LARGE_1000
+
+#define _UTF8_BYTE_2_HIGH \
+    _UTF8_TOO_SHORT, _UTF8_TOO_SHORT, _UTF8_TOO_SHORT, _UTF8_TOO_SHORT, \
+    _UTF8_TOO_SHORT, _UTF8_TOO_SHORT, _UTF8_TOO_SHORT, _UTF8_TOO_SHORT, \
+    _UTF8_TOO_LONG | _UTF8_OVERLONG_2 | _UTF8_TWO_CONTS | _UTF8_OVERLONG_3 | _UTF8_TOO_LARGE_1000 | _UTF8_OVERLONG_4, \
+    _UTF8_TOO_LONG | _UTF8_OVERLONG_2 | _UTF8_TWO_CONTS | _UTF8_OVERLONG_3 | _UTF8_TOO_LARGE, \
+    _UTF8_TOO_LONG | _UTF8_OVERLONG_2 | _UTF8_TWO_CONTS | _UTF8_SURROGATE | _UTF8_TOO_LARGE, \
+    _UTF8_TOO_LONG | _UTF8_OVERLONG_2 | _UTF8_TWO_CONTS | _UTF8_SURROGATE | _UTF8_TOO_LARGE, \
+    _UTF8_TOO_SHORT, _UTF8_TOO_SHORT, _UTF8_TOO_SHORT, _UTF8_TOO_SHORT
+
+static bool _utf8_valid_scalar(const u8 *p, usize len) {
+    usize i = 0;
+    while (i < len) {
+        if (p[i] < 0x80) {
+            i++;
+            continue;
         }
-        *ptr = 0;
-        break;
+        u32 cp;
+        int n = utf8_decode(p + i, len - i, &cp);
+        if (n == 1) return false;
+        i += n;
     }
+    return true;
+}
 
-    return str;
+#if SIMD_AVX2
+static bool _utf8_valid_simd(const u8 *p, usize len) {
+    const __m256i t1h = _mm256_setr_epi8(_UTF8_BYTE_1_HIGH, _UTF8_BYTE_1_HIGH);
+    const __m256i t1l = _mm256_setr_epi8(_UTF8_BYTE_1_LOW, _UTF8_BYTE_1_LOW);
+    const __m256i t2h = _mm256_setr_epi8(_UTF8_BYTE_2_HIGH, _UTF8_BYTE_2_HIGH);
+    const __m256i nib = _mm256_set1_epi8(0x0f);
+    const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+
+    usize i = 0;
+    u8 pad[32];
+    while (i < len) {
+        __m256i in;
+        if (i + 32 <= len) {
+            in = _mm256_loadu_si256((const __m256i*)(p + i));
+        } else {
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, p + i, len - i);
+            in = _mm256_loadu_si256((const __m256i*)pad);
+        }
+        i += 32;
+
+        if (!_mm256_movemask_epi8(in)) {
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = _mm256_setzero_si256();
+            prev = in;
+            continue;
+        }
+
+        __m256i shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(in, shifted, 15);
+        __m256i prev2 = _mm256_alignr_epi8(in, shifted, 14);
+        __m256i prev3 = _mm256_alignr_epi8(in, shifted, 13);
+
+        __m256i b1h = _mm256_shuffle_epi8(t1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib));
+        __m256i b1l = _mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, nib));
+        __m256i b2h = _mm256_shuffle_epi8(t2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), nib));
+        __m256i special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+        __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80)));
+        __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80)));
+        __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+        error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+
+        prev_incomplete = _mm256_subs_epu8(in, max);
+        prev = in;
+    }
+
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+}
+#elif SIMD_SSSE3
+static bool _utf8_valid_simd(const u8 *p, usize len) {
+    const __m128i t1h = _mm_setr_epi8(_UTF8_BYTE_1_HIGH);
+    const __m128i t1l = _mm_setr_epi8(_UTF8_BYTE_1_LOW);
+    const __m128i t2h = _mm_setr_epi8(_UTF8_BYTE_2_HIGH);
+    const __m128i nib = _mm_set1_epi8(0x0f);
+    const __m128i max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                      (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+    __m128i error = _mm_setzero_si128();
+    __m128i prev = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128();
+
+    usize i = 0;
+    u8 pad[16];
+    while (i < len) {
+        __m128i in;
+        if (i + 16 <= len) {
+            in = _mm_loadu_si128((const __m128i*)(p + i));
+        } else {
+            memset(pad, 0, sizeof(pad));
+            memcpy(pad, p + i, len - i);
+            in = _mm_loadu_si128((const __m128i*)pad);
+        }
+        i += 16;
+
+        if (!_mm_movemask_epi8(in)) {
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+            prev = in;
+            continue;
+        }
+
+        __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+        __m128i prev2 = _mm_alignr_epi8(in, prev, 14);
+        __m128i prev3 = _mm_alignr_epi8(in, prev, 13);
+
+        __m128i b1h = _mm_shuffle_epi8(t1h, _mm_and_si128(_mm_srli_epi16(prev1, 4), nib));
+        __m128i b1l = _mm_shuffle_epi8(t1l, _mm_and_si128(prev1, nib));
+        __m128i b2h = _mm_shuffle_epi8(t2h, _mm_and_si128(_mm_srli_epi16(in, 4), nib));
+        __m128i special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+        __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+        __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+        __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+        error = _mm_or_si128(error, _mm_xor_si128(must23, special));
+
+        prev_incomplete = _mm_subs_epu8(in, max);
+        prev = in;
+    }
+
+    error = _mm_or_si128(error, prev_incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+}
+#elif SIMD_SSE2
+// No byte shuffle: skip ASCII blocks with SSE2 and validate the rest scalar.
+// Blocks are resynced on a lead byte so a sequence never straddles the split.
+static bool _utf8_valid_simd(const u8 *p, usize len) {
+    usize i = 0;
+    while (i < len) {
+        for (; i + 16 <= len; i += 16) {
+            if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)))) break;
+        }
+        usize end = i + 64 < len ? i + 64 : len;
+        while (end < len && (p[end] & 0xc0) == 0x80) end++;
+        if (!_utf8_valid_scalar(p + i, end - i)) return false;
+        i = end;
+    }
+    return true;
+}
+#endif
+
+// True when str is well-formed UTF-8 (no overlongs, surrogates or values
+// above U+10FFFF)
+static bool utf8_valid(String str) {
+#if SIMD_SSE2 || SIMD_SSSE3
+    return _utf8_valid_simd((const u8*)str.data, str.len);
+#else
+    return _utf8_valid_scalar((const u8*)str.data, str.len);
+#endif
+}
+
+// Number of codepoints in str, counted as the bytes that aren't continuation
+// bytes. Only meaningful for valid UTF-8.
+static usize utf8_count(String str) {
+    const u8 *p = (const u8*)str.data;
+    usize count = 0;
+    int i = 0;
+#if SIMD_WIDTH
+    // Continuation bytes are 0x80..0xbf, i.e. <= -65 as signed bytes
+    SimdVec limit = simd_splat((u8)-65);
+    for (; i + SIMD_WIDTH <= str.len; i += SIMD_WIDTH) {
+        count += __builtin_popcount(simd_mask(simd_gt(simd_load(p + i), limit)));
+    }
+#endif
+    for (; i < str.len; ++i) {
+        count += (p[i] & 0xc0) != 0x80;
+    }
+    return count;
+}
+
+// Walks the codepoints of a String. Malformed bytes yield U+FFFD.
+typedef struct {
+    String rest;
+} Utf8Iter;
+
+static Utf8Iter utf8_iter(String str) {
+    return (Utf8Iter){.rest = str};
+}
+
+static bool utf8_iter_next(Utf8Iter *it, u32 *cp) {
+    if (it->rest.len <= 0) return false;
+    const u8 *p = (const u8*)it->rest.data;
+    int n = 1;
+    if (p[0] < 0x80)
+        *cp = p[0];
+    else
+        n = utf8_decode(p, it->rest.len, cp);
+    it->rest.data += n;
+    it->rest.len -= n;
+    return true;
 }
 
 static bool string_match(String a, String b) {
@@ -201,44 +826,189 @@ static String string_concat(Allocator *alloc, String *strings, int count) {
     return out;
 }
 
+/* PATHS */
+
+// Path helpers that return views into the input or write into a caller's
+// buffer; none of them allocate except path_join. '\\' is also a separator on
+// Windows.
+
+#ifdef _WIN32
+#define PATH_SEP '\\'
+#else
+#define PATH_SEP '/'
+#endif
+
+static inline bool path_is_sep(char c) {
+#ifdef _WIN32
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
+}
+
+// Path without trailing separators, keeping a lone root
+static String _path_trim(String path) {
+    while (path.len > 1 && path_is_sep(path.data[path.len - 1])) path.len--;
+    return path;
+}
+
+// Last component: "a/b/" gives "b", "/" gives "/"
+static String path_basename(String path) {
+    path = _path_trim(path);
+    if (path.len == 1) return path;
+    int i = path.len;
+    while (i > 0 && !path_is_sep(path.data[i - 1])) i--;
+    return string_slice(path, i, path.len);
+}
+
+// Everything before the last component: "a/b" gives "a", "a" gives ".",
+// "/a" gives "/"
+static String path_dirname(String path) {
+    path = _path_trim(path);
+    int i = path.len;
+    while (i > 0 && !path_is_sep(path.data[i - 1])) i--;
+    if (i == 0) return (String){.data = ".", .len = 1};
+    while (i > 1 && path_is_sep(path.data[i - 1])) i--;
+    return string_slice(path, 0, i);
+}
+
+// Extension of the last component from its last dot, dot included: "a.b/c.txt"
+// gives ".txt". Leading dots don't count, so ".bashrc" and ".." have none.
+static String path_ext(String path) {
+    String base = path_basename(path);
+    int lead = 0;
+    while (lead < base.len && base.data[lead] == '.') lead++;
+    for (int i = base.len - 1; i > lead; --i) {
+        if (base.data[i] == '.') return string_slice(base, i, base.len);
+    }
+    return (String){0};
+}
+
+// Lexically normalizes path into out: collapses repeated separators, drops "."
+// and resolves ".." against the preceding component. ".." above the root is
+// dropped, leading ".." of a relative path is kept and an empty result is ".".
+// Returns the length, or -1 if out is too small. out may alias path.data; it is
+// null-terminated when there is room.
+static int path_normalize(String path, char *out, int cap) {
+    bool root = path.len > 0 && path_is_sep(path.data[0]);
+    int len = 0;
+    int base = root ? 1 : 0;    // out[0..base) can never be popped
+    int depth = 0;              // components in out that ".." can remove
+    if (root) {
+        if (cap < 1) return -1;
+        out[len++] = PATH_SEP;
+    }
+
+    int i = 0;
+    while (i < path.len) {
+        while (i < path.len && path_is_sep(path.data[i])) i++;
+        int start = i;
+        while (i < path.len && !path_is_sep(path.data[i])) i++;
+        int n = i - start;
+        if (n == 0 || (n == 1 && path.data[start] == '.')) continue;
+
+        if (n == 2 && path.data[start] == '.' && path.data[start + 1] == '.') {
+            if (depth > 0) {
+                while (len > base && !path_is_sep(out[len - 1])) len--;
+                if (len > base) len--;
+                depth--;
+                continue;
+            }
+            if (root) continue;
+        } else {
+            depth++;
+        }
+
+        int need = len + (len > base) + n;
+        if (need > cap) return -1;
+        if (len > base) out[len++] = PATH_SEP;
+        memmove(out + len, path.data + start, n);
+        len += n;
+    }
+
+    if (len == 0) {
+        if (cap < 1) return -1;
+        out[len++] = '.';
+    }
+    if (len < cap) out[len] = 0;
+    return len;
+}
+
+// Joins parts into out with exactly one separator between non-empty parts.
+// Returns the length, or -1 if out is too small. out is null-terminated when
+// there is room.
+static int path_join_buf(char *out, int cap, const String *parts, int count) {
+    int len = 0;
+    for (int i = 0; i < count; ++i) {
+        String part = parts[i];
+        if (part.len == 0) continue;
+        if (len > 0) {
+            bool has_sep = path_is_sep(out[len - 1]);
+            if (has_sep && path_is_sep(part.data[0])) {
+                part = string_slice(part, 1, part.len);
+            } else if (!has_sep && !path_is_sep(part.data[0])) {
+                if (len + 1 > cap) return -1;
+                out[len++] = PATH_SEP;
+            }
+        }
+        if (len + part.len > cap) return -1;
+        memcpy(out + len, part.data, part.len);
+        len += part.len;
+    }
+    if (len < cap) out[len] = 0;
+    return len;
+}
+
 static String path_join(Allocator *alloc, String *paths, int count) {
-    int sep_count = count - 1;
-    int size = 0;
+    int size = count;
     for (int i = 0; i < count; ++i) {
         size += paths[i].len;
     }
     String str = {0};
-    str.len = sep_count + size;
-    char *ptr = str.data = alloc->alloc(alloc, str.len + 1);
+    str.data = alloc->alloc(alloc, size + 1);
     if (!str.data) {
         err("Allocation failed\n");
         return str;
     }
-    for (int i = 0; i < count; ++i) {
-        String *path = &paths[i];
-        memcpy(ptr, path->data, path->len);
-        ptr += path->len;
-        if (i + 1 != count) {
-            memcpy(ptr, "/", 1);
-            ptr++;
-        }
-    }
-
-    *ptr = 0;
-
+    str.len = path_join_buf(str.data, size + 1, paths, count);
     return str;
 }
 
-static int string_get_count_of(String str, char c) {
-    int count = 0;
-    for (int i = 0; i < str.len; ++i) {
-        if (str.data[i] == c)
-            count += 1;
+// Pointer to the first occurrence of c in [data, data + len), or NULL.
+// Takes a usize length so it also works on buffers past the String limit.
+static const char *mem_find_byte(const void *data, usize len, u8 c) {
+    const u8 *p = (const u8*)data;
+    usize i = 0;
+#if SIMD_WIDTH
+    SimdVec needle = simd_splat(c);
+    for (; i + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+        u32 mask = simd_mask(simd_eq(simd_load(p + i), needle));
+        if (mask) return (const char*)p + i + bit_first(mask);
     }
+#endif
+    for (; i < len; ++i) {
+        if (p[i] == c) return (const char*)p + i;
+    }
+    return NULL;
+}
 
+// Number of occurrences of c in [data, data + len)
+static usize mem_count_byte(const void *data, usize len, u8 c) {
+    const u8 *p = (const u8*)data;
+    usize count = 0, i = 0;
+#if SIMD_WIDTH
+    SimdVec needle = simd_splat(c);
+    for (; i + SIMD_WIDTH <= len; i += SIMD_WIDTH)
+        count += __builtin_popcount(simd_mask(simd_eq(simd_load(p + i), needle)));
+#endif
+    for (; i < len; ++i) count += p[i] == c;
     return count;
 }
 
+static int string_get_count_of(String str, char c) {
+    return (int)mem_count_byte(str.data, str.len, (u8)c);
+}
+
 static String string_split_until(String str, char delim) {
     char *ptr = str.data;
     char *end = str.data + str.len;
@@ -269,6 +1039,334 @@ static String string_split_after(String str, char delim) {
     return (String){0};
 }
 
+/* SUBSTRING SEARCH */
+
+// Needles longer than this use Two-Way instead of the SIMD filter, which can
+// degrade to O(n*m) on adversarial input.
+#ifndef STRING_FIND_TWO_WAY_MIN
+#define STRING_FIND_TWO_WAY_MIN 32
+#endif
+
+// Byte i of p (of length len), read from the back when rev is set. Lets the
+// Two-Way search run in both directions without copying.
+static inline u8 _two_way_at(const u8 *p, int len, int i, bool rev) {
+    return rev ? p[len - 1 - i] : p[i];
+}
+
+static int _two_way_max_suffix(const u8 *x, int m, int *period, bool tilde, bool rev) {
+    int ms = -1, j = 0, k = 1, p = 1;
+    while (j + k < m) {
+        u8 a = _two_way_at(x, m, j + k, rev);
+        u8 b = _two_way_at(x, m, ms + k, rev);
+        if (tilde ? a > b : a < b) {
+            j += k;
+            k = 1;
+            p = j - ms;
+        } else if (a == b) {
+            if (k != p) {
+                k++;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            ms = j;
+            j = ms + 1;
+            k = p = 1;
+        }
+    }
+    *period = p;
+    return ms;
+}
+
+// Crochemore-Perrin Two-Way: linear time, constant space.
+// With rev set, both strings are read back to front and the result is the
+// offset of the last match measured from the end of the haystack.
+static int _string_find_two_way(const u8 *y, int n, const u8 *x, int m, bool rev) {
+    int p, q;
+    int i = _two_way_max_suffix(x, m, &p, false, rev);
+    int j = _two_way_max_suffix(x, m, &q, true, rev);
+    int ell = i > j ? i : j;
+    int per = i > j ? p : q;
+
+    bool periodic = true;
+    for (int k = 0; k <= ell; ++k) {
+        if (_two_way_at(x, m, k, rev) != _two_way_at(x, m, k + per, rev)) {
+            periodic = false;
+            break;
+        }
+    }
+
+    if (periodic) {
+        int memory = -1;
+        j = 0;
+        while (j <= n - m) {
+            i = (ell > memory ? ell : memory) + 1;
+            while (i < m && _two_way_at(x, m, i, rev) == _two_way_at(y, n, i + j, rev)) i++;
+            if (i >= m) {
+                i = ell;
+                while (i > memory && _two_way_at(x, m, i, rev) == _two_way_at(y, n, i + j, rev)) i--;
+                if (i <= memory) return j;
+                j += per;
+                memory = m - per - 1;
+            } else {
+                j += i - ell;
+                memory = -1;
+            }
+        }
+    } else {
+        per = (ell + 1 > m - ell - 1 ? ell + 1 : m - ell - 1) + 1;
+        j = 0;
+        while (j <= n - m) {
+            i = ell + 1;
+            while (i < m && _two_way_at(x, m, i, rev) == _two_way_at(y, n, i + j, rev)) i++;
+            if (i >= m) {
+                i = ell;
+                while (i >= 0 && _two_way_at(x, m, i, rev) == _two_way_at(y, n, i + j, rev)) i--;
+                if (i < 0) return j;
+                j += per;
+            } else {
+                j += i - ell;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Offset of the first occurrence of c in str, or -1
+static int string_find_char(String str, char c) {
+    const char *at = mem_find_byte(str.data, str.len, (u8)c);
+    return at ? (int)(at - str.data) : -1;
+}
+
+// Offset of the last occurrence of c in str, or -1
+static int string_find_last_char(String str, char c) {
+    const u8 *p = (const u8*)str.data;
+    int i = str.len;
+#if SIMD_WIDTH
+    SimdVec needle = simd_splat((u8)c);
+    for (; i - SIMD_WIDTH >= 0; i -= SIMD_WIDTH) {
+        u32 mask = simd_mask(simd_eq(simd_load(p + i - SIMD_WIDTH), needle));
+        if (mask) return i - SIMD_WIDTH + bit_last(mask);
+    }
+#endif
+    while (i-- > 0) {
+        if (p[i] == (u8)c) return i;
+    }
+    return -1;
+}
+
+// Returns the byte offset of the first occurrence of needle in haystack, or -1.
+// An empty needle matches at 0.
+static int string_find(String haystack, String needle) {
+    const u8 *h = (const u8*)haystack.data;
+    const u8 *n = (const u8*)needle.data;
+    int hlen = haystack.len;
+    int m = needle.len;
+
+    if (m == 0) return 0;
+    if (m > hlen) return -1;
+    if (m == 1) return string_find_char(haystack, needle.data[0]);
+    if (m >= STRING_FIND_TWO_WAY_MIN) return _string_find_two_way(h, hlen, n, m, false);
+
+    int i = 0;
+#if SIMD_WIDTH
+    // Compare the first and last needle byte against two shifted loads, and
+    // only memcmp the candidates where both line up
+    SimdVec first = simd_splat(n[0]);
+    SimdVec last = simd_splat(n[m - 1]);
+    for (; i + m - 1 + SIMD_WIDTH <= hlen; i += SIMD_WIDTH) {
+        SimdVec a = simd_eq(simd_load(h + i), first);
+        SimdVec b = simd_eq(simd_load(h + i + m - 1), last);
+        u32 mask = simd_mask(simd_and(a, b));
+        while (mask) {
+            int bit = bit_first(mask);
+            if (memcmp(h + i + bit + 1, n + 1, m - 2) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i <= hlen - m; ++i) {
+        if (h[i] == n[0] && h[i + m - 1] == n[m - 1] && memcmp(h + i + 1, n + 1, m - 2) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Returns the byte offset of the last occurrence of needle in haystack, or -1.
+// An empty needle matches at haystack.len.
+static int string_find_last(String haystack, String needle) {
+    const u8 *h = (const u8*)haystack.data;
+    const u8 *n = (const u8*)needle.data;
+    int hlen = haystack.len;
+    int m = needle.len;
+
+    if (m == 0) return hlen;
+    if (m > hlen) return -1;
+    if (m == 1) return string_find_last_char(haystack, needle.data[0]);
+    if (m >= STRING_FIND_TWO_WAY_MIN) {
+        int r = _string_find_two_way(h, hlen, n, m, true);
+        return r < 0 ? -1 : hlen - m - r;
+    }
+
+    // i is one past the last candidate start still to be checked
+    int i = hlen - m + 1;
+#if SIMD_WIDTH
+    SimdVec first = simd_splat(n[0]);
+    SimdVec last = simd_splat(n[m - 1]);
+    for (; i - SIMD_WIDTH >= 0; i -= SIMD_WIDTH) {
+        int base = i - SIMD_WIDTH;
+        SimdVec a = simd_eq(simd_load(h + base), first);
+        SimdVec b = simd_eq(simd_load(h + base + m - 1), last);
+        u32 mask = simd_mask(simd_and(a, b));
+        while (mask) {
+            int bit = bit_last(mask);
+            if (memcmp(h + base + bit + 1, n + 1, m - 2) == 0) return base + bit;
+            mask &= ~(1u << bit);
+        }
+    }
+#endif
+    while (i-- > 0) {
+        if (h[i] == n[0] && h[i + m - 1] == n[m - 1] && memcmp(h + i + 1, n + 1, m - 2) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static bool string_contains(String haystack, String needle) {
+    return string_find(haystack, needle) >= 0;
+}
+
+// Returns a view of the first match of needle inside haystack, or an empty
+// String with a NULL data pointer when there is none
+static String string_find_view(String haystack, String needle) {
+    int at = string_find(haystack, needle);
+    if (at < 0) return (String){0};
+    return (String){
+        .data = haystack.data + at,
+        .len = needle.len,
+    };
+}
+
+// Offset of the first byte in str that is any of the bytes in set, or -1
+static int string_find_any(String str, String set) {
+    const u8 *p = (const u8*)str.data;
+    if (set.len == 0) return -1;
+    if (set.len == 1) return string_find_char(str, set.data[0]);
+
+    int i = 0;
+#if SIMD_WIDTH
+    // Small sets are OR'd compares; larger ones fall through to the table
+    if (set.len <= 8) {
+        SimdVec splats[8];
+        for (int k = 0; k < set.len; ++k) splats[k] = simd_splat((u8)set.data[k]);
+        for (; i + SIMD_WIDTH <= str.len; i += SIMD_WIDTH) {
+            SimdVec v = simd_load(p + i);
+            SimdVec hit = simd_eq(v, splats[0]);
+            for (int k = 1; k < set.len; ++k) hit = simd_or(hit, simd_eq(v, splats[k]));
+            u32 mask = simd_mask(hit);
+            if (mask) return i + bit_first(mask);
+        }
+    }
+#endif
+    u8 table[256] = {0};
+    for (int k = 0; k < set.len; ++k) table[(u8)set.data[k]] = 1;
+    for (; i < str.len; ++i) {
+        if (table[p[i]]) return i;
+    }
+    return -1;
+}
+
+/* SPLIT ITERATOR */
+
+typedef u32 StringSplitFlag;
+enum StringSplitFlags {
+    StringSplit_SkipEmpty = 1 << 0, // don't yield zero-length fields
+    StringSplit_AnyOf = 1 << 1,     // delim is a set of single-byte delimiters
+};
+
+// Streams fields out of a String without allocating. Fields are views into the
+// source string. N delimiters give N+1 fields, an empty source gives none.
+typedef struct {
+    String rest;
+    String delim;
+    StringSplitFlag flags;
+    bool done;
+} StringSplitIter;
+
+static StringSplitIter string_split_iter(String str, String delim, StringSplitFlag flags) {
+    return (StringSplitIter){
+        .rest = str,
+        .delim = delim,
+        .flags = flags,
+        .done = str.len == 0,
+    };
+}
+
+// Writes the next field to out. Returns false once the source is exhausted.
+static bool string_split_next(StringSplitIter *it, String *out) {
+    while (!it->done) {
+        int at, skip;
+        if (it->flags & StringSplit_AnyOf) {
+            at = string_find_any(it->rest, it->delim);
+            skip = 1;
+        } else {
+            at = it->delim.len ? string_find(it->rest, it->delim) : -1;
+            skip = it->delim.len;
+        }
+
+        String field;
+        if (at < 0) {
+            field = it->rest;
+            it->done = true;
+        } else {
+            field = string_slice(it->rest, 0, at);
+            it->rest = string_slice(it->rest, at + skip, it->rest.len);
+        }
+
+        if ((it->flags & StringSplit_SkipEmpty) && field.len == 0)
+            continue;
+
+        *out = field;
+        return true;
+    }
+
+    return false;
+}
+
+/* LINE ITERATOR */
+
+// Walks a buffer line by line without allocating. Lines are views into the
+// buffer with the '\n' or "\r\n" terminator removed. A final line without a
+// terminator is still yielded, a trailing terminator does not start a new one.
+typedef struct {
+    const char *pos;
+    const char *end;
+} LineIter;
+
+static LineIter line_iter(const char *data, usize len) {
+    return (LineIter){data, data + len};
+}
+
+static LineIter string_lines(String str) {
+    return line_iter(str.data, str.len);
+}
+
+// Writes the next line to out. Returns false once the buffer is exhausted.
+static bool line_iter_next(LineIter *it, String *out) {
+    if (it->pos >= it->end) return false;
+
+    const char *start = it->pos;
+    const char *nl = mem_find_byte(start, it->end - start, '\n');
+    const char *line_end = nl ? nl : it->end;
+    it->pos = nl ? nl + 1 : it->end;
+    if (nl && line_end > start && line_end[-1] == '\r') line_end--;
+
+    *out = (String){.data = (char*)start, .len = (int)(line_end - start)};
+    return true;
+}
+
 static StringArray string_split_delim(Allocator *alloc, String str, char delim) {
     StringArray arr = {0};
     int delim_count = string_get_count_of(str, delim);
@@ -297,20 +1395,582 @@ static StringArray string_split_delim(Allocator *alloc, String str, char delim)
     return arr;
 }
 
+static void string_print(String str) {
+    fwrite(str.data, 1, str.len, stdout);
+}
+
 static void string_println(String str) {
-    for (int i = 0; i < str.len; ++i) {
-        putc(str.data[i], stdout);
-    }
+    fwrite(str.data, 1, str.len, stdout);
     putc('\n', stdout);
 }
 
+/* STRING BUILDER */
+
+// Growable byte buffer for assembling strings out of many small pieces.
+// Capacity doubles on growth; on an Arena the buffer extends in place while it
+// is the most recent allocation. The contents are always null-terminated.
+typedef struct {
+    Allocator *alloc;
+    char *data;
+    int len;
+    int cap;
+} StringBuilder;
+
+static bool string_builder_reserve(StringBuilder *sb, int extra);
+
+static StringBuilder string_builder_init(Allocator *alloc, int capacity) {
+    StringBuilder sb = {.alloc = alloc};
+    string_builder_reserve(&sb, capacity > 0 ? capacity : 64);
+    return sb;
+}
+
+// Ensures there is room for extra more bytes plus the null terminator
+static bool string_builder_reserve(StringBuilder *sb, int extra) {
+    i64 needed = (i64)sb->len + extra + 1;
+    if (needed <= sb->cap) return true;
+    if (extra < 0 || needed > INT_MAX) {
+        err("String builder would exceed INT_MAX bytes\n");
+        return false;
+    }
+
+    i64 cap = sb->cap ? sb->cap : 64;
+    while (cap < needed) cap *= 2;
+    if (cap > INT_MAX) cap = INT_MAX;
+
+    char *data;
+    if (sb->data && sb->alloc->realloc) {
+        data = (char*)sb->alloc->realloc(sb->alloc, sb->data, cap);
+    } else {
+        data = (char*)sb->alloc->alloc(sb->alloc, cap);
+        if (data && sb->data) memcpy(data, sb->data, sb->len);
+    }
+    if (!data) {
+        err("Allocation failed\n");
+        return false;
+    }
+
+    sb->data = data;
+    sb->cap = (int)cap;
+    sb->data[sb->len] = 0;
+    return true;
+}
+
+static void string_builder_append_bytes(StringBuilder *sb, const char *bytes, int len) {
+    if (!string_builder_reserve(sb, len)) return;
+    memcpy(sb->data + sb->len, bytes, len);
+    sb->len += len;
+    sb->data[sb->len] = 0;
+}
+
+static void string_builder_append(StringBuilder *sb, String str) {
+    string_builder_append_bytes(sb, str.data, str.len);
+}
+
+static void string_builder_append_cstr(StringBuilder *sb, const char *cstr) {
+    string_builder_append_bytes(sb, cstr, string_len(cstr));
+}
+
+static void string_builder_append_char(StringBuilder *sb, char c) {
+    if (!string_builder_reserve(sb, 1)) return;
+    sb->data[sb->len++] = c;
+    sb->data[sb->len] = 0;
+}
+
+static void string_builder_append_u64(StringBuilder *sb, u64 value) {
+    char buf[20];
+    char *ptr = buf + sizeof(buf);
+    do {
+        *--ptr = '0' + (char)(value % 10);
+        value /= 10;
+    } while (value);
+    string_builder_append_bytes(sb, ptr, (int)(buf + sizeof(buf) - ptr));
+}
+
+static void string_builder_append_i64(StringBuilder *sb, i64 value) {
+    if (value < 0) {
+        string_builder_append_char(sb, '-');
+        string_builder_append_u64(sb, 0 - (u64)value);
+    } else {
+        string_builder_append_u64(sb, (u64)value);
+    }
+}
+
+// Appends value in %g notation with the given number of significant digits
+static void string_builder_append_f64(StringBuilder *sb, f64 value, int precision) {
+    char buf[64];
+    int len = stbsp_snprintf(buf, sizeof(buf), "%.*g", precision, value);
+    string_builder_append_bytes(sb, buf, len);
+}
+
+// stb_sprintf writes straight into the builder's storage; each callback
+// commits what was written and hands back room for the next chunk
+static char *_string_builder_sprintf_cb(const char *buf, void *user, int len) {
+    (void)buf;
+    StringBuilder *sb = (StringBuilder*)user;
+    sb->len += len;
+    if (!string_builder_reserve(sb, STB_SPRINTF_MIN)) {
+        sb->data[sb->len] = 0;
+        return NULL;
+    }
+    return sb->data + sb->len;
+}
+
+static void string_builder_appendfv(StringBuilder *sb, const char *fmt, va_list args) {
+    if (!string_builder_reserve(sb, STB_SPRINTF_MIN)) return;
+    stbsp_vsprintfcb(_string_builder_sprintf_cb, sb, sb->data + sb->len, fmt, args);
+    sb->data[sb->len] = 0;
+}
+
+static void string_builder_appendf(StringBuilder *sb, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    string_builder_appendfv(sb, fmt, args);
+    va_end(args);
+}
+
+// Current contents as a view. Invalidated by the next append.
+static String string_builder_view(StringBuilder *sb) {
+    return (String){
+        .data = sb->data,
+        .len = sb->len,
+    };
+}
+
+// Hands the buffer over as a String without copying. The builder is left
+// empty and the String is owned by the builder's allocator.
+static String string_builder_finish(StringBuilder *sb) {
+    String str = string_builder_view(sb);
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+    return str;
+}
+
+static void string_builder_reset(StringBuilder *sb) {
+    sb->len = 0;
+    if (sb->data) sb->data[0] = 0;
+}
+
+static void string_builder_deinit(StringBuilder *sb) {
+    if (sb->data && sb->alloc->free) sb->alloc->free(sb->alloc, sb->data);
+    *sb = (StringBuilder){.alloc = sb->alloc};
+}
+
+/* PACKED STRING ARRAY */
+
+// StringArray alternative that keeps every string's bytes back to back in one
+// buffer. Entry i is data[offsets[i] .. offsets[i + 1]), so each entry costs 4
+// bytes of header instead of 16 and walking the array reads memory in order.
+// Views returned by get are invalidated when an append grows the buffer.
+typedef struct {
+    Allocator *alloc;
+    char *data;
+    u32 len;
+    u32 cap;
+    u32 *offsets;       // count + 1 entries
+    int count;
+    int offsets_cap;    // entries the offsets buffer can hold
+} PackedStringArray;
+
+static PackedStringArray packed_string_array_init(Allocator *alloc, int count, usize bytes) {
+    PackedStringArray psa = {.alloc = alloc};
+    psa.offsets_cap = (count > 0 ? count : 16) + 1;
+    psa.cap = bytes > 0 && bytes < UINT32_MAX ? (u32)bytes : 256;
+    psa.offsets = (u32*)alloc->alloc(alloc, psa.offsets_cap * sizeof(u32));
+    psa.data = (char*)alloc->alloc(alloc, psa.cap);
+    if (!psa.offsets || !psa.data) {
+        err("Allocation failed\n");
+        if (alloc->free) {
+            if (psa.offsets) alloc->free(alloc, psa.offsets);
+            if (psa.data) alloc->free(alloc, psa.data);
+        }
+        return (PackedStringArray){.alloc = alloc};
+    }
+    psa.offsets[0] = 0;
+    return psa;
+}
+
+// Like string_builder_reserve, copies when the allocator can't realloc
+static void *_packed_string_array_grow(Allocator *alloc, void *ptr, usize used, usize size) {
+    if (ptr && alloc->realloc) return alloc->realloc(alloc, ptr, size);
+    void *grown = alloc->alloc(alloc, size);
+    if (grown && ptr) {
+        memcpy(grown, ptr, used);
+        if (alloc->free) alloc->free(alloc, ptr);
+    }
+    return grown;
+}
+
+static bool packed_string_array_append(PackedStringArray *psa, String str) {
+    if ((u64)psa->len + str.len >= UINT32_MAX) {
+        err("Packed string array exceeds 4GiB\n");
+        return false;
+    }
+    if (psa->count + 2 > psa->offsets_cap) {
+        // A zeroed or failed-init array starts from nothing
+        int cap = psa->offsets_cap * 2 > 16 ? psa->offsets_cap * 2 : 16;
+        usize used = psa->offsets ? (usize)(psa->count + 1) * sizeof(u32) : 0;
+        u32 *offsets = (u32*)_packed_string_array_grow(psa->alloc, psa->offsets, used, cap * sizeof(u32));
+        if (!offsets) {
+            err("Allocation failed\n");
+            return false;
+        }
+        if (!psa->offsets) offsets[0] = 0;
+        psa->offsets = offsets;
+        psa->offsets_cap = cap;
+    }
+    if (psa->len + (u32)str.len > psa->cap) {
+        u64 cap = psa->cap ? (u64)psa->cap * 2 : 256;
+        while (cap < (u64)psa->len + str.len) cap *= 2;
+        if (cap >= UINT32_MAX) cap = UINT32_MAX - 1;
+        char *data = (char*)_packed_string_array_grow(psa->alloc, psa->data, psa->len, cap);
+        if (!data) {
+            err("Allocation failed\n");
+            return false;
+        }
+        psa->data = data;
+        psa->cap = (u32)cap;
+    }
+
+    memcpy(psa->data + psa->len, str.data, str.len);
+    psa->len += str.len;
+    psa->offsets[++psa->count] = psa->len;
+    return true;
+}
+
+static inline String packed_string_array_get(const PackedStringArray *psa, int i) {
+    u32 start = psa->offsets[i];
+    return (String){.data = psa->data + start, .len = (int)(psa->offsets[i + 1] - start)};
+}
+
+// Packs the fields of str split on delim, with string_split_delim's rules: a
+// trailing delimiter doesn't add an empty field. Two allocations in total.
+static PackedStringArray packed_string_array_from_split(Allocator *alloc, String str, char delim) {
+    int delims = string_get_count_of(str, delim);
+    PackedStringArray psa = packed_string_array_init(alloc, delims + 1, str.len - delims);
+    if (!psa.data) return psa;
+
+    const char *p = str.data;
+    const char *end = str.data + str.len;
+    while (p < end) {
+        const char *at = mem_find_byte(p, end - p, (u8)delim);
+        if (!at) at = end;
+        memcpy(psa.data + psa.len, p, at - p);
+        psa.len += (u32)(at - p);
+        psa.offsets[++psa.count] = psa.len;
+        p = at + 1;
+    }
+    return psa;
+}
+
+static PackedStringArray packed_string_array_from_string_array(Allocator *alloc, StringArray sa) {
+    usize bytes = 0;
+    for (int i = 0; i < sa.count; ++i) bytes += sa.strings[i].len;
+    PackedStringArray psa = packed_string_array_init(alloc, sa.count, bytes);
+    if (!psa.data) return psa;
+
+    for (int i = 0; i < sa.count; ++i) {
+        if (!packed_string_array_append(&psa, sa.strings[i])) break;
+    }
+    return psa;
+}
+
+// StringArray of views into psa's buffer, which must outlive it
+static StringArray packed_string_array_to_string_array(Allocator *alloc, const PackedStringArray *psa) {
+    StringArray sa = {0};
+    sa.strings = (String*)alloc->alloc(alloc, (psa->count ? psa->count : 1) * sizeof(String));
+    if (!sa.strings) {
+        err("String alloc failed\n");
+        return sa;
+    }
+    for (int i = 0; i < psa->count; ++i) sa.strings[i] = packed_string_array_get(psa, i);
+    sa.count = psa->count;
+    sa.cap = psa->count ? psa->count : 1;
+    return sa;
+}
+
+static void packed_string_array_deinit(PackedStringArray *psa) {
+    if (psa->alloc->free) {
+        psa->alloc->free(psa->alloc, psa->data);
+        psa->alloc->free(psa->alloc, psa->offsets);
+    }
+    *psa = (PackedStringArray){.alloc = psa->alloc};
+}
+
+/* SORTING */
+
+// Bytewise three-way comparison: <0, 0 or >0
+static int string_compare(String a, String b) {
+    int n = a.len < b.len ? a.len : b.len;
+    int c = n ? memcmp(a.data, b.data, n) : 0;
+    if (c) return c;
+    return (a.len > b.len) - (a.len < b.len);
+}
+
+// Multikey quicksort over an 8-byte window of each string. The window is cached
+// next to the string as a big-endian u64, so partitioning compares integers in
+// a contiguous array instead of chasing every string's data pointer.
+typedef struct {
+    u64 key;
+    String str;
+} _StringSortItem;
+
+#define _STRING_SORT_SMALL 16
+
+static inline u64 _string_sort_key(String s, usize depth) {
+    usize rest = (usize)s.len > depth ? s.len - depth : 0;
+    const u8 *p = (const u8*)s.data + depth;
+    if (rest >= 8) {
+        u64 k;
+        memcpy(&k, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return k;
+#else
+        return __builtin_bswap64(k);
+#endif
+    }
+    u64 k = 0;
+    for (usize i = 0; i < rest; ++i) k |= (u64)p[i] << (56 - 8 * i);
+    return k;
+}
+
+static inline void _string_sort_swap(_StringSortItem *a, _StringSortItem *b) {
+    _StringSortItem t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// All items share their first depth bytes
+static void _string_sort_small(_StringSortItem *items, usize n, usize depth) {
+    for (usize i = 1; i < n; ++i) {
+        _StringSortItem x = items[i];
+        String xs = string_slice(x.str, depth, x.str.len);
+        usize j = i;
+        for (; j > 0; --j) {
+            _StringSortItem *y = &items[j - 1];
+            if (y->key < x.key) break;
+            if (y->key == x.key && string_compare(string_slice(y->str, depth, y->str.len), xs) <= 0) break;
+            items[j] = *y;
+        }
+        items[j] = x;
+    }
+}
+
+static inline int _string_sort_compare(const _StringSortItem *a, const _StringSortItem *b, usize depth) {
+    if (a->key != b->key) return a->key < b->key ? -1 : 1;
+    return string_compare(string_slice(a->str, depth, a->str.len), string_slice(b->str, depth, b->str.len));
+}
+
+static void _string_sort_sift(_StringSortItem *items, usize root, usize n, usize depth) {
+    for (;;) {
+        usize child = 2 * root + 1;
+        if (child >= n) return;
+        if (child + 1 < n && _string_sort_compare(&items[child], &items[child + 1], depth) < 0) child++;
+        if (_string_sort_compare(&items[root], &items[child], depth) >= 0) return;
+        _string_sort_swap(&items[root], &items[child]);
+        root = child;
+    }
+}
+
+// For partitions the median of three keeps splitting badly, as in introsort
+static void _string_sort_heap(_StringSortItem *items, usize n, usize depth) {
+    for (usize i = n / 2; i-- > 0;) _string_sort_sift(items, i, n, depth);
+    while (n > 1) {
+        _string_sort_swap(&items[0], &items[--n]);
+        _string_sort_sift(items, 0, n, depth);
+    }
+}
+
+// Partitions allowed before falling back to heapsort: twice log2(n)
+static int _string_sort_budget(usize n) {
+    int budget = 0;
+    while (n >>= 1) budget += 2;
+    return budget;
+}
+
+typedef struct {
+    _StringSortItem *items;
+    usize n;
+    usize depth;
+    int budget;
+} _StringSortPart;
+
+static void _string_sort(_StringSortItem *items, usize n, usize depth, int budget) {
+    while (n > 1) {
+        if (n < _STRING_SORT_SMALL) {
+            _string_sort_small(items, n, depth);
+            return;
+        }
+        if (budget-- == 0) {
+            _string_sort_heap(items, n, depth);
+            return;
+        }
+
+        // Median of three, then a three-way partition on the cached keys
+        u64 a = items[0].key, b = items[n / 2].key, c = items[n - 1].key;
+        u64 pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+        usize lt = 0, i = 0, gt = n;
+        while (i < gt) {
+            if (items[i].key < pivot) _string_sort_swap(&items[lt++], &items[i++]);
+            else if (items[i].key > pivot) _string_sort_swap(&items[i], &items[--gt]);
+            else i++;
+        }
+
+        // Equal windows: strings ending inside the window are prefixes of the
+        // rest and differ only in length (by at most 8), so bucket them by
+        // length in place and continue one window deeper with the others.
+        _StringSortItem *eq = items + lt;
+        usize eq_n = gt - lt;
+        usize done = 0;
+        for (usize len = depth; len <= depth + 8; ++len) {
+            for (usize k = done; k < eq_n; ++k) {
+                if ((usize)eq[k].str.len == len) _string_sort_swap(&eq[done++], &eq[k]);
+            }
+        }
+
+        usize rest = eq_n - done;
+        for (usize k = 0; k < rest; ++k) eq[done + k].key = _string_sort_key(eq[done + k].str, depth + 8);
+
+        // Recurse into the two smaller parts, each at most half of n, and loop
+        // on the largest, so the stack stays O(log n) deep
+        _StringSortPart parts[3] = {
+            {items, lt, depth, budget},
+            {items + gt, n - gt, depth, budget},
+            {eq + done, rest, depth + 8, _string_sort_budget(rest)},
+        };
+        int big = 0;
+        for (int k = 1; k < 3; ++k) {
+            if (parts[k].n > parts[big].n) big = k;
+        }
+        for (int k = 0; k < 3; ++k) {
+            if (k != big) _string_sort(parts[k].items, parts[k].n, parts[k].depth, parts[k].budget);
+        }
+        items = parts[big].items;
+        n = parts[big].n;
+        depth = parts[big].depth;
+        budget = parts[big].budget;
+    }
+}
+
+// Sorts count strings bytewise ascending. Needs 24 bytes of scratch per string.
+static bool string_sort(Allocator *alloc, String *strings, int count) {
+    if (count < 2) return true;
+    _StringSortItem *items = (_StringSortItem*)alloc->alloc(alloc, count * sizeof(_StringSortItem));
+    if (!items) {
+        err("Allocation failed\n");
+        return false;
+    }
+
+    for (int i = 0; i < count; ++i) items[i] = (_StringSortItem){_string_sort_key(strings[i], 0), strings[i]};
+    _string_sort(items, count, 0, _string_sort_budget(count));
+    for (int i = 0; i < count; ++i) strings[i] = items[i].str;
+
+    if (alloc->free) alloc->free(alloc, items);
+    return true;
+}
+
+static bool string_array_sort(Allocator *alloc, StringArray *sa) {
+    return string_sort(alloc, sa->strings, sa->count);
+}
+
+// Drops adjacent duplicates in place, returns the new count. Run after sorting
+// to remove every duplicate.
+static int string_unique(String *strings, int count) {
+    if (count < 2) return count;
+    int out = 1;
+    for (int i = 1; i < count; ++i) {
+        if (!string_match(strings[i], strings[out - 1])) strings[out++] = strings[i];
+    }
+    return out;
+}
+
+static bool string_array_sort_unique(Allocator *alloc, StringArray *sa) {
+    if (!string_array_sort(alloc, sa)) return false;
+    sa->count = string_unique(sa->strings, sa->count);
+    return true;
+}
+
+// Index of the first string >= key in a sorted array, count if there is none
+static int string_lower_bound(const String *strings, int count, String key) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (string_compare(strings[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Index of key in a sorted array, or -1
+static int string_array_search(const StringArray *sa, String key) {
+    int i = string_lower_bound(sa->strings, sa->count, key);
+    return i < sa->count && string_match(sa->strings[i], key) ? i : -1;
+}
+
+/* FORMATTING */
+
+#ifndef STRING_PRINTF_STACK
+#define STRING_PRINTF_STACK (STB_SPRINTF_MIN * 4)
+#endif
+
+// Output is formatted onto the stack first and only moves into a
+// StringBuilder once it outgrows the stack buffer
+typedef struct {
+    StringBuilder sb;
+    int used;
+    bool spilled;
+    char stack[STRING_PRINTF_STACK];
+} _StringPrintfCtx;
+
+static char *_string_printf_cb(const char *buf, void *user, int len) {
+    _StringPrintfCtx *ctx = (_StringPrintfCtx*)user;
+    if (ctx->spilled)
+        return _string_builder_sprintf_cb(buf, &ctx->sb, len);
+
+    ctx->used += len;
+    if (ctx->used + STB_SPRINTF_MIN <= STRING_PRINTF_STACK)
+        return ctx->stack + ctx->used;
+
+    ctx->spilled = true;
+    string_builder_append_bytes(&ctx->sb, ctx->stack, ctx->used);
+    if (!string_builder_reserve(&ctx->sb, STB_SPRINTF_MIN))
+        return NULL;
+    return ctx->sb.data + ctx->sb.len;
+}
+
+// Formats into an exactly-sized, null-terminated allocation
 static String string_printfv(Allocator *alloc, const char *fmt, va_list args) {
-    char *buf = (char *)alloc->alloc(alloc, string_len(fmt) * 2);
-    int len = stbsp_vsprintf(buf, fmt, args);
+    _StringPrintfCtx ctx;
+    ctx.sb = (StringBuilder){.alloc = alloc};
+    ctx.used = 0;
+    ctx.spilled = false;
+    stbsp_vsprintfcb(_string_printf_cb, &ctx, ctx.stack, fmt, args);
+
+    if (ctx.spilled) {
+        if (!string_builder_reserve(&ctx.sb, 0)) {
+            if (ctx.sb.data && alloc->free) alloc->free(alloc, ctx.sb.data);
+            return (String){0};
+        }
+        ctx.sb.data[ctx.sb.len] = 0;
+        String str = string_builder_finish(&ctx.sb);
+        if (alloc->realloc) {
+            char *trimmed = (char*)alloc->realloc(alloc, str.data, str.len + 1);
+            if (trimmed) str.data = trimmed;
+        }
+        return str;
+    }
+
+    char *buf = (char*)alloc->alloc(alloc, ctx.used + 1);
+    if (!buf) {
+        err("Allocation failed\n");
+        return (String){0};
+    }
+    memcpy(buf, ctx.stack, ctx.used);
+    buf[ctx.used] = 0;
 
     return (String){
         .data = buf,
-        .len = len,
+        .len = ctx.used,
     };
 }
 
@@ -323,4 +1983,24 @@ static String string_printf(Allocator *alloc, const char *fmt, ...) {
     return result;
 }
 
+// Formats straight into the arena's head allocation, growing it in place as
+// needed, then trims it to the exact size. Nothing is staged or copied.
+static String string_printfv_arena(Arena *arena, const char *fmt, va_list args) {
+    StringBuilder sb = string_builder_init(&arena->allocator, STB_SPRINTF_MIN);
+    string_builder_appendfv(&sb, fmt, args);
+    String str = string_builder_finish(&sb);
+    if (str.data)
+        str.data = (char*)arena_realloc(arena, str.data, str.len + 1);
+    return str;
+}
+
+static String string_printf_arena(Arena *arena, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    String result = string_printfv_arena(arena, fmt, args);
+    va_end(args);
+
+    return result;
+}
+
 #endif
@@ -0,0 +1,59 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+// Minimal threading on top of pthreads: a parallel-for that splits an index
+// range across threads.
+
+#include "types.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Number of online CPUs, at least 1
+static int thread_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/* PARALLEL FOR */
+
+typedef void (*ParallelForFn)(void *ctx, usize index);
+
+typedef struct {
+    ParallelForFn fn;
+    void *ctx;
+    usize count;
+    atomic_size_t next;
+} _ParallelFor;
+
+static void *_parallel_for_worker(void *arg) {
+    _ParallelFor *pf = (_ParallelFor*)arg;
+    for (;;) {
+        usize i = atomic_fetch_add(&pf->next, 1);
+        if (i >= pf->count) break;
+        pf->fn(pf->ctx, i);
+    }
+    return NULL;
+}
+
+// Calls fn(ctx, i) for every i in [0, count) on up to threads threads (0 for
+// one per CPU), the calling thread included. Returns once all calls are done.
+static void parallel_for(int threads, usize count, ParallelForFn fn, void *ctx) {
+    if (threads <= 0) threads = thread_count();
+    if ((usize)threads > count) threads = (int)count;
+
+    _ParallelFor pf = {.fn = fn, .ctx = ctx, .count = count};
+    atomic_init(&pf.next, 0);
+
+    pthread_t workers[threads > 1 ? threads - 1 : 1];
+    int started = 0;
+    for (int i = 0; i < threads - 1; ++i) {
+        if (pthread_create(&workers[started], NULL, _parallel_for_worker, &pf) == 0)
+            started++;
+    }
+    _parallel_for_worker(&pf);
+    for (int i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+}
+
+#endif
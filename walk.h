@@ -0,0 +1,327 @@
+#ifndef WALK_H
+#define WALK_H
+
+// Parallel recursive directory walk. Each worker thread owns a deque of
+// directories still to be listed and steals from the others when its own runs
+// dry. Listings come from getdents64 in large batches on Linux (readdir
+// elsewhere) and d_type decides files from directories without a stat.
+
+#include "allocator.h"
+#include "fs.h"
+#include "log.h"
+#include "strings.h"
+#include "thread.h"
+#include "types.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define WALK_DENTS_BUFFER KB(64)
+// Paths are carved out of slabs this size in the worker's arena
+#define _WALK_SLAB KB(256)
+
+typedef struct {
+    String path;        // root joined with the entry's relative path
+    String relative;    // path below the root, a view into path
+    String name;        // last component, a view into path
+    FileType type;
+    int depth;          // 0 for entries directly inside the root
+} WalkEntry;
+
+// Return false to drop an entry. Called from worker threads.
+typedef bool (*WalkFilterFn)(void *user, const WalkEntry *entry);
+typedef void (*WalkVisitFn)(void *user, const WalkEntry *entry, int thread);
+
+typedef struct {
+    int threads;            // 0 for one per CPU
+    int max_depth;          // deepest depth reported, < 0 for no limit
+    String ext;             // only report files with this extension, e.g. ".wav"
+    bool dirs;              // report directories as well as files
+    // Decides whether a directory is descended into, e.g. to prune a subtree
+    WalkFilterFn descend;
+    // Decides whether an entry that passed the other checks is reported
+    WalkFilterFn filter;
+    void *filter_user;
+    // Streams reported entries; when NULL they are collected in the result
+    WalkVisitFn visit;
+    void *visit_user;
+} WalkOptions;
+
+typedef struct {
+    Arena arena;            // paths of this thread's entries
+    Array(WalkEntry) entries;
+} WalkThreadResult;
+
+typedef struct {
+    WalkThreadResult *threads;
+    int thread_count;
+    usize files;
+    usize dirs;
+    usize errors;           // directories that couldn't be listed
+} WalkResult;
+
+typedef struct {
+    String path;
+    int depth;
+} _WalkJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Array(_WalkJob) jobs;   // owner works at the back, thieves take the front
+    usize front;
+    WalkThreadResult *out;
+    u8 *slab;
+    usize slab_left;
+    u8 *dents;
+    usize files, dirs, errors;
+} _WalkWorker;
+
+typedef struct {
+    const WalkOptions *opts;
+    _WalkWorker *workers;
+    int count;
+    int root_skip;          // bytes of root and separator ahead of relative paths
+    atomic_size_t pending;  // directories queued or being listed
+    LibCAllocator heap;
+} _Walk;
+
+static void *_walk_alloc(_WalkWorker *w, usize size) {
+    size = (size + 7) & ~(usize)7;
+    if (size > w->slab_left) {
+        usize slab = size > _WALK_SLAB ? size : _WALK_SLAB;
+        w->slab = (u8*)arena_alloc(&w->out->arena, slab);
+        if (!w->slab) {
+            w->slab_left = 0;
+            return NULL;
+        }
+        w->slab_left = slab;
+    }
+    void *p = w->slab;
+    w->slab += size;
+    w->slab_left -= size;
+    return p;
+}
+
+static void _walk_push(_Walk *walk, _WalkWorker *w, _WalkJob job) {
+    atomic_fetch_add(&walk->pending, 1);
+    pthread_mutex_lock(&w->lock);
+    array_append(&walk->heap.allocator, &w->jobs, job);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static bool _walk_pop(_WalkWorker *w, _WalkJob *job) {
+    bool ok = false;
+    pthread_mutex_lock(&w->lock);
+    if (w->jobs.len > w->front) {
+        *job = w->jobs.items[--w->jobs.len];
+        ok = true;
+    }
+    if (w->jobs.len == w->front) w->jobs.len = w->front = 0;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// Takes the oldest job, which tends to be the largest remaining subtree
+static bool _walk_steal(_WalkWorker *w, _WalkJob *job) {
+    bool ok = false;
+    if (pthread_mutex_trylock(&w->lock) != 0) return false;
+    if (w->jobs.len > w->front) {
+        *job = w->jobs.items[w->front++];
+        ok = true;
+    }
+    if (w->jobs.len == w->front) w->jobs.len = w->front = 0;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// Case-insensitive, since asset extensions come in both cases
+static bool _walk_ext_match(String name, String ext) {
+    String e = path_ext(name);
+    if (e.len != ext.len) return false;
+    for (int i = 0; i < e.len; ++i) {
+        char a = e.data[i], b = ext.data[i];
+        if (a >= 'A' && a <= 'Z') a += 32;
+        if (b >= 'A' && b <= 'Z') b += 32;
+        if (a != b) return false;
+    }
+    return true;
+}
+
+static void _walk_entry(_Walk *walk, _WalkWorker *w, int index, int dir_fd, const _WalkJob *job, const char *name, u8 d_type) {
+    const WalkOptions *o = walk->opts;
+    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) return;
+
+    FileType type = FileType_Invalid;
+    if (d_type == DT_DIR) type = FileType_Dir;
+    else if (d_type == DT_REG) type = FileType_File;
+    else if (d_type == DT_LNK) type = FileType_Link;
+    else if (d_type == DT_UNKNOWN) {
+        // Some filesystems don't fill d_type
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (S_ISDIR(st.st_mode)) type = FileType_Dir;
+            else if (S_ISREG(st.st_mode)) type = FileType_File;
+            else if (S_ISLNK(st.st_mode)) type = FileType_Link;
+        }
+    }
+
+    int name_len = string_len(name);
+    bool sep = job->path.len && !path_is_sep(job->path.data[job->path.len - 1]);
+    int len = job->path.len + sep + name_len;
+    char *path = (char*)_walk_alloc(w, len + 1);
+    if (!path) return;
+    memcpy(path, job->path.data, job->path.len);
+    if (sep) path[job->path.len] = PATH_SEP;
+    memcpy(path + len - name_len, name, name_len + 1);
+
+    WalkEntry entry = {
+        .path = {path, len},
+        .relative = {path + walk->root_skip, len - walk->root_skip},
+        .name = {path + len - name_len, name_len},
+        .type = type,
+        .depth = job->depth,
+    };
+
+    if (type == FileType_Dir) {
+        bool deeper = o->max_depth < 0 || entry.depth < o->max_depth;
+        if (deeper && (!o->descend || o->descend(o->filter_user, &entry)))
+            _walk_push(walk, w, (_WalkJob){entry.path, entry.depth + 1});
+        if (!o->dirs) return;
+    } else if (o->ext.len && !_walk_ext_match(entry.name, o->ext)) {
+        return;
+    }
+    if (o->filter && !o->filter(o->filter_user, &entry)) return;
+
+    if (type == FileType_Dir) w->dirs++;
+    else w->files++;
+    if (o->visit) o->visit(o->visit_user, &entry, index);
+    else array_append(&walk->heap.allocator, &w->out->entries, entry);
+}
+
+static void _walk_dir(_Walk *walk, int index, const _WalkJob *job) {
+    _WalkWorker *w = &walk->workers[index];
+    int fd = open(job->path.data, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        w->errors++;
+        return;
+    }
+
+#ifdef __linux__
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, w->dents, WALK_DENTS_BUFFER);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) w->errors++;
+        if (n <= 0) break;
+        for (long off = 0; off < n;) {
+            // struct linux_dirent64: ino, off, reclen, type, name
+            u8 *d = w->dents + off;
+            u16 reclen;
+            memcpy(&reclen, d + 16, sizeof(reclen));
+            _walk_entry(walk, w, index, fd, job, (const char*)d + 19, d[18]);
+            off += reclen;
+        }
+    }
+    close(fd);
+#else
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        w->errors++;
+        return;
+    }
+    struct dirent *d;
+    while ((d = readdir(dir))) _walk_entry(walk, w, index, fd, job, d->d_name, d->d_type);
+    closedir(dir);
+#endif
+}
+
+static void _walk_worker(void *ctx, usize index) {
+    _Walk *walk = (_Walk*)ctx;
+    _WalkJob job;
+    int idle = 0;
+    for (;;) {
+        bool found = _walk_pop(&walk->workers[index], &job);
+        for (int k = 1; !found && k < walk->count; ++k)
+            found = _walk_steal(&walk->workers[(index + k) % walk->count], &job);
+
+        if (found) {
+            _walk_dir(walk, (int)index, &job);
+            atomic_fetch_sub(&walk->pending, 1);
+            idle = 0;
+            continue;
+        }
+        // Nothing queued anywhere and nobody listing: the walk is done
+        if (atomic_load(&walk->pending) == 0) break;
+        if (++idle < 64) sched_yield();
+        else usleep(50);
+    }
+}
+
+// Walks the tree under root. Entries are streamed to opts->visit or collected
+// per thread in result, with their paths in that thread's arena either way.
+// Free the result with walk_result_deinit.
+static bool dir_walk(const char *root, const WalkOptions *opts, WalkResult *result) {
+    memset(result, 0, sizeof(*result));
+    _Walk walk = {.opts = opts, .heap = heap_allocator_init()};
+    Allocator *heap = &walk.heap.allocator;
+    walk.count = opts->threads > 0 ? opts->threads : thread_count();
+    walk.workers = (_WalkWorker*)calloc(walk.count, sizeof(_WalkWorker));
+    result->threads = (WalkThreadResult*)calloc(walk.count, sizeof(WalkThreadResult));
+    if (!walk.workers || !result->threads) {
+        err("Allocation failed\n");
+        free(walk.workers);
+        return false;
+    }
+    result->thread_count = walk.count;
+    atomic_init(&walk.pending, 0);
+
+    for (int i = 0; i < walk.count; ++i) {
+        _WalkWorker *w = &walk.workers[i];
+        w->out = &result->threads[i];
+        w->out->arena = arena_init(MB(1));
+        array_init_capacity(heap, &w->out->entries, 256);
+        array_init_capacity(heap, &w->jobs, 64);
+        pthread_mutex_init(&w->lock, NULL);
+        w->dents = (u8*)heap->alloc(heap, WALK_DENTS_BUFFER);
+    }
+
+    int root_len = string_len(root);
+    char *root_copy = (char*)_walk_alloc(&walk.workers[0], root_len + 1);
+    memcpy(root_copy, root, root_len + 1);
+    walk.root_skip = root_len + (root_len && !path_is_sep(root[root_len - 1]));
+    _walk_push(&walk, &walk.workers[0], (_WalkJob){{root_copy, root_len}, 0});
+
+    parallel_for(walk.count, walk.count, _walk_worker, &walk);
+
+    for (int i = 0; i < walk.count; ++i) {
+        _WalkWorker *w = &walk.workers[i];
+        result->files += w->files;
+        result->dirs += w->dirs;
+        result->errors += w->errors;
+        pthread_mutex_destroy(&w->lock);
+        heap->free(heap, w->jobs.items);
+        heap->free(heap, w->dents);
+    }
+    free(walk.workers);
+    return true;
+}
+
+static void walk_result_deinit(WalkResult *result) {
+    for (int i = 0; i < result->thread_count; ++i) {
+        arena_deinit(&result->threads[i].arena);
+        free(result->threads[i].entries.items);
+    }
+    free(result->threads);
+    memset(result, 0, sizeof(*result));
+}
+
+#endif
@@ -0,0 +1,462 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+// Change tracking for a directory tree. The watcher keeps a snapshot of every
+// entry below its root and updates it from inotify, so each poll only costs
+// the events that happened. Events on the same path between two polls are
+// coalesced against the snapshot: a file created and deleted in between isn't
+// reported at all, and a file deleted and recreated is reported as modified.
+// Only when the kernel queue overflows is the tree rescanned and diffed.
+
+#ifdef __linux__
+
+#include "allocator.h"
+#include "fs.h"
+#include "log.h"
+#include "strings.h"
+#include "types.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_READ_BUFFER KB(64)
+
+#define _WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                     IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | IN_EXCL_UNLINK | IN_ONLYDIR)
+
+typedef u32 WatchEventKind;
+enum WatchEventKinds {
+    WatchEvent_Create,
+    WatchEvent_Modify,
+    WatchEvent_Delete,
+};
+
+typedef struct {
+    WatchEventKind kind;
+    FileType type;
+    String path;        // relative to the root, valid until the next poll
+} WatchEvent;
+
+typedef struct {
+    char *path;         // relative to the root, NULL for an empty slot
+    int len;
+    u32 hash;
+    FileType type;
+    u64 size;
+    i64 mtime;          // nanoseconds
+    int wd;             // watch descriptor of a directory, otherwise -1
+    bool exists;
+    bool existed;       // whether it existed as of the last poll
+    bool dirty;         // changed since the last poll
+    bool queued;
+    bool seen;          // found by the rescan in progress
+} WatchEntry;
+
+typedef struct {
+    Allocator *alloc;
+    int fd;
+    char *root;
+    int root_len;
+
+    // Snapshot, open addressed with linear probing
+    WatchEntry *entries;
+    usize entry_count;
+    usize entry_cap;
+
+    char **dirs;        // relative path of each watched directory by wd
+    int dir_cap;
+
+    Array(char*) queued;        // paths touched since the last poll, in order
+    Array(WatchEvent) events;
+    Array(char*) released;      // paths of deleted entries, freed next poll
+    u8 *buffer;
+    bool overflow;
+} Watcher;
+
+static u32 _watch_hash(const char *s, int len) {
+    u32 h = 2166136261u;
+    for (int i = 0; i < len; ++i) h = (h ^ (u8)s[i]) * 16777619u;
+    return h;
+}
+
+static usize _watch_slot(const Watcher *w, const char *path, int len, u32 hash) {
+    usize mask = w->entry_cap - 1;
+    usize i = hash & mask;
+    while (w->entries[i].path) {
+        WatchEntry *e = &w->entries[i];
+        if (e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0) break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static bool _watch_grow(Watcher *w) {
+    usize old_cap = w->entry_cap;
+    WatchEntry *old = w->entries;
+    usize cap = old_cap ? old_cap * 2 : 1024;
+    w->entries = (WatchEntry*)w->alloc->alloc(w->alloc, cap * sizeof(WatchEntry));
+    if (!w->entries) {
+        w->entries = old;
+        return false;
+    }
+    memset(w->entries, 0, cap * sizeof(WatchEntry));
+    w->entry_cap = cap;
+    for (usize i = 0; i < old_cap; ++i) {
+        if (old[i].path) w->entries[_watch_slot(w, old[i].path, old[i].len, old[i].hash)] = old[i];
+    }
+    if (old) w->alloc->free(w->alloc, old);
+    return true;
+}
+
+static WatchEntry *_watch_find(Watcher *w, const char *path, int len) {
+    WatchEntry *e = &w->entries[_watch_slot(w, path, len, _watch_hash(path, len))];
+    return e->path ? e : NULL;
+}
+
+// Entry for path, added as not existing if it's new. NULL if out of memory.
+static WatchEntry *_watch_entry(Watcher *w, const char *path, int len) {
+    if ((w->entry_count + 1) * 4 > w->entry_cap * 3 && !_watch_grow(w)) return NULL;
+    u32 hash = _watch_hash(path, len);
+    WatchEntry *e = &w->entries[_watch_slot(w, path, len, hash)];
+    if (e->path) return e;
+
+    char *copy = (char*)w->alloc->alloc(w->alloc, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, path, len);
+    copy[len] = 0;
+    *e = (WatchEntry){.path = copy, .len = len, .hash = hash, .wd = -1};
+    w->entry_count++;
+    return e;
+}
+
+// Backward-shift deletion, which keeps probe chains intact without tombstones
+static void _watch_remove(Watcher *w, WatchEntry *e) {
+    usize mask = w->entry_cap - 1;
+    usize i = (usize)(e - w->entries);
+    array_append(w->alloc, &w->released, e->path);
+    w->entries[i] = (WatchEntry){0};
+    w->entry_count--;
+    for (usize j = (i + 1) & mask; w->entries[j].path; j = (j + 1) & mask) {
+        usize home = w->entries[j].hash & mask;
+        // Move j into the hole unless its home lies cyclically in (i, j]
+        bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if (stays) continue;
+        w->entries[i] = w->entries[j];
+        w->entries[j] = (WatchEntry){0};
+        i = j;
+    }
+}
+
+static void _watch_touch(Watcher *w, WatchEntry *e) {
+    if (e->queued) return;
+    e->queued = true;
+    array_append(w->alloc, &w->queued, e->path);
+}
+
+static void _watch_set_dir(Watcher *w, int wd, const char *path, int len) {
+    if (wd >= w->dir_cap) {
+        int cap = w->dir_cap ? w->dir_cap : 64;
+        while (cap <= wd) cap *= 2;
+        char **dirs = (char**)w->alloc->realloc(w->alloc, w->dirs, cap * sizeof(char*));
+        if (!dirs) return;
+        memset(dirs + w->dir_cap, 0, (cap - w->dir_cap) * sizeof(char*));
+        w->dirs = dirs;
+        w->dir_cap = cap;
+    }
+    if (w->dirs[wd]) w->alloc->free(w->alloc, w->dirs[wd]);
+    w->dirs[wd] = (char*)w->alloc->alloc(w->alloc, len + 1);
+    if (w->dirs[wd]) {
+        memcpy(w->dirs[wd], path, len);
+        w->dirs[wd][len] = 0;
+    }
+}
+
+static void _watch_drop_dir(Watcher *w, int wd) {
+    if (wd < 0 || wd >= w->dir_cap || !w->dirs[wd]) return;
+    w->alloc->free(w->alloc, w->dirs[wd]);
+    w->dirs[wd] = NULL;
+}
+
+// Joins the root and a relative path into buf, PATH_MAX bytes
+static bool _watch_full_path(const Watcher *w, const char *rel, int len, char *buf) {
+    if (w->root_len + 1 + len + 1 > PATH_MAX) return false;
+    memcpy(buf, w->root, w->root_len);
+    int n = w->root_len;
+    if (len) {
+        buf[n++] = PATH_SEP;
+        memcpy(buf + n, rel, len);
+        n += len;
+    }
+    buf[n] = 0;
+    return true;
+}
+
+static FileType _watch_type(mode_t mode) {
+    if (S_ISDIR(mode)) return FileType_Dir;
+    if (S_ISREG(mode)) return FileType_File;
+    if (S_ISLNK(mode)) return FileType_Link;
+    return FileType_Invalid;
+}
+
+// Records that path exists with the given stat. Attribute-only updates mark
+// the entry dirty only if its size or mtime actually moved.
+static WatchEntry *_watch_update(Watcher *w, const char *path, int len, const struct stat *st, bool attrib) {
+    WatchEntry *e = _watch_entry(w, path, len);
+    if (!e) return NULL;
+    FileType type = _watch_type(st->st_mode);
+    i64 mtime = (i64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    bool changed = !e->exists || e->type != type || e->size != (u64)st->st_size || e->mtime != mtime;
+    if (type != FileType_Dir && (changed || !attrib)) e->dirty = true;
+    if (changed || !attrib) _watch_touch(w, e);
+    e->exists = true;
+    e->type = type;
+    e->size = (u64)st->st_size;
+    e->mtime = mtime;
+    e->seen = true;
+    return e;
+}
+
+static void _watch_add_dir(Watcher *w, WatchEntry *e, const char *full) {
+    int wd = inotify_add_watch(w->fd, full, _WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC) err("Out of inotify watches watching %s\n", full);
+        return;
+    }
+    e->wd = wd;
+    _watch_set_dir(w, wd, e->path, e->len);
+}
+
+// Adds everything below the directory at rel to the snapshot and watches it
+static void _watch_scan(Watcher *w, const char *rel, int len) {
+    char path[PATH_MAX];
+    if (!_watch_full_path(w, rel, len, path)) return;
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    int dir_len = string_len(path);
+    // Relative paths of the children start after the root and its separator
+    int skip = w->root_len + 1;
+    path[dir_len++] = PATH_SEP;
+
+    for (DirIterator it = dir_iter_next(dir); it.ok; it = dir_iter_next(dir)) {
+        const char *name = it.file_info->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) continue;
+        int name_len = string_len(name);
+        if (dir_len + name_len >= PATH_MAX) continue;
+        memcpy(path + dir_len, name, name_len + 1);
+
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        WatchEntry *e = _watch_update(w, path + skip, dir_len + name_len - skip, &st, true);
+        // The watch goes on before the directory is listed, so nothing
+        // created in it afterwards is missed
+        if (e && e->type == FileType_Dir) {
+            _watch_add_dir(w, e, path);
+            _watch_scan(w, e->path, e->len);
+        }
+    }
+    closedir(dir);
+}
+
+static void _watch_delete(Watcher *w, WatchEntry *e) {
+    if (!e->exists) return;
+    e->exists = false;
+    _watch_touch(w, e);
+    if (e->wd >= 0) {
+        inotify_rm_watch(w->fd, e->wd);
+        _watch_drop_dir(w, e->wd);
+        e->wd = -1;
+    }
+}
+
+// Deletes everything below the directory at path, for directories moved away
+// with their contents. This sweeps the whole table, so it's kept off the
+// delete path: a directory can only be removed once empty, and its children
+// have had their own IN_DELETE events by then.
+static void _watch_delete_under(Watcher *w, const char *path, int len) {
+    for (usize i = 0; i < w->entry_cap; ++i) {
+        WatchEntry *e = &w->entries[i];
+        if (e->path && e->exists && e->len > len && path_is_sep(e->path[len]) && memcmp(e->path, path, len) == 0)
+            _watch_delete(w, e);
+    }
+}
+
+static void _watch_event(Watcher *w, const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        w->overflow = true;
+        return;
+    }
+    if (ev->mask & IN_IGNORED) {
+        _watch_drop_dir(w, ev->wd);
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= w->dir_cap || !w->dirs[ev->wd] || !ev->len) return;
+
+    const char *dir = w->dirs[ev->wd];
+    int dir_len = string_len(dir);
+    int name_len = string_len(ev->name);
+    char rel[PATH_MAX];
+    if (dir_len + 1 + name_len >= PATH_MAX) return;
+    int len = 0;
+    if (dir_len) {
+        memcpy(rel, dir, dir_len);
+        len = dir_len;
+        rel[len++] = PATH_SEP;
+    }
+    memcpy(rel + len, ev->name, name_len);
+    len += name_len;
+    rel[len] = 0;
+
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        WatchEntry *e = _watch_find(w, rel, len);
+        if (!e) return;
+        if (e->type == FileType_Dir && (ev->mask & IN_MOVED_FROM)) _watch_delete_under(w, rel, len);
+        _watch_delete(w, e);
+        return;
+    }
+
+    char full[PATH_MAX];
+    struct stat st;
+    if (!_watch_full_path(w, rel, len, full) || lstat(full, &st) != 0) return;
+    bool attrib = !(ev->mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE));
+    WatchEntry *e = _watch_update(w, rel, len, &st, attrib);
+    if (e && e->type == FileType_Dir && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        _watch_add_dir(w, e, full);
+        _watch_scan(w, e->path, e->len);
+    }
+}
+
+// Turns the touched entries into events and makes the snapshot current
+static void _watch_report(Watcher *w) {
+    w->events.len = 0;
+    for each(char*, path, &w->queued) {
+        WatchEntry *e = _watch_find(w, *path, string_len(*path));
+        if (!e) continue;
+        WatchEvent ev = {.type = e->type, .path = {e->path, e->len}};
+        bool report = true;
+        if (e->existed && !e->exists) ev.kind = WatchEvent_Delete;
+        else if (!e->existed && e->exists) ev.kind = WatchEvent_Create;
+        else if (e->exists && e->dirty) ev.kind = WatchEvent_Modify;
+        else report = false;
+        if (report) array_append(w->alloc, &w->events, ev);
+
+        e->existed = e->exists;
+        e->dirty = false;
+        e->queued = false;
+        // Deleted paths stay allocated for the events until the next poll
+        if (!e->exists) _watch_remove(w, e);
+    }
+    w->queued.len = 0;
+}
+
+static void _watch_release(Watcher *w) {
+    for each(char*, path, &w->released) w->alloc->free(w->alloc, *path);
+    w->released.len = 0;
+}
+
+// Rescans the tree and diffs it against the snapshot. Done automatically when
+// inotify's queue overflowed and events were lost.
+static void watcher_rescan(Watcher *w) {
+    for (usize i = 0; i < w->entry_cap; ++i) w->entries[i].seen = false;
+    int wd = inotify_add_watch(w->fd, w->root, _WATCH_MASK);
+    if (wd >= 0) _watch_set_dir(w, wd, "", 0);
+    _watch_scan(w, "", 0);
+    for (usize i = 0; i < w->entry_cap; ++i) {
+        WatchEntry *e = &w->entries[i];
+        if (e->path && e->exists && !e->seen) _watch_delete(w, e);
+    }
+    w->overflow = false;
+}
+
+static void watcher_deinit(Watcher *w) {
+    if (w->fd >= 0) close(w->fd);
+    Allocator *a = w->alloc;
+    for (usize i = 0; i < w->entry_cap; ++i) {
+        if (w->entries[i].path) a->free(a, w->entries[i].path);
+    }
+    for (int i = 0; i < w->dir_cap; ++i) {
+        if (w->dirs[i]) a->free(a, w->dirs[i]);
+    }
+    _watch_release(w);
+    a->free(a, w->entries);
+    a->free(a, w->dirs);
+    a->free(a, w->queued.items);
+    a->free(a, w->events.items);
+    a->free(a, w->released.items);
+    a->free(a, w->buffer);
+    a->free(a, w->root);
+    *w = (Watcher){.fd = -1};
+}
+
+// Starts watching the tree under root. The initial scan fills the snapshot
+// without producing events.
+static bool watcher_init(Watcher *w, Allocator *alloc, const char *root) {
+    *w = (Watcher){.alloc = alloc};
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd < 0) {
+        err("inotify_init1 failed: %s\n", strerror(errno));
+        return false;
+    }
+    w->root_len = string_len(root);
+    while (w->root_len > 1 && path_is_sep(root[w->root_len - 1])) w->root_len--;
+    w->root = (char*)alloc->alloc(alloc, w->root_len + 1);
+    w->buffer = (u8*)alloc->alloc(alloc, WATCH_READ_BUFFER);
+    array_init_capacity(alloc, &w->queued, 256);
+    array_init_capacity(alloc, &w->events, 256);
+    array_init_capacity(alloc, &w->released, 64);
+    if (!w->root || !w->buffer || !_watch_grow(w)) {
+        watcher_deinit(w);
+        return false;
+    }
+    memcpy(w->root, root, w->root_len);
+    w->root[w->root_len] = 0;
+
+    struct stat st;
+    if (stat(w->root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        err("Failed to watch %s: not a directory\n", w->root);
+        watcher_deinit(w);
+        return false;
+    }
+    watcher_rescan(w);
+    _watch_report(w);
+    w->events.len = 0;
+    return true;
+}
+
+// Waits up to timeout_ms (-1 forever, 0 not at all) for changes, then applies
+// everything queued. Returns the number of coalesced events in w->events.
+static int watcher_poll(Watcher *w, int timeout_ms) {
+    _watch_release(w);
+    w->events.len = 0;
+
+    struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+    if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+
+    for (;;) {
+        isize n = read(w->fd, w->buffer, WATCH_READ_BUFFER);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (isize off = 0; off < n;) {
+            const struct inotify_event *ev = (const struct inotify_event*)(w->buffer + off);
+            _watch_event(w, ev);
+            off += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (w->overflow) watcher_rescan(w);
+    _watch_report(w);
+    return (int)w->events.len;
+}
+
+// Snapshot entry for a path relative to the root, NULL if it doesn't exist
+static const WatchEntry *watcher_lookup(const Watcher *w, String path) {
+    const WatchEntry *e = _watch_find((Watcher*)w, path.data, path.len);
+    return e && e->existed ? e : NULL;
+}
+
+#endif // __linux__
+
+#endif